@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* IMA ADPCM, in the block layout used in .wav files, mono.
+ *
+ * Each block starts with a header: the first sample, as 16 bits (little
+ * endian), then the step index, then a zero byte. The rest of the block is
+ * four bit codes, two to a byte, low nibble first, one per sample after the
+ * first. Each block can be decoded on its own, so playback can start at any
+ * block boundary.
+ *
+ * The decoder is what the box runs. The encoder is here for host tools.
+ */
+
+namespace ImaAdpcm {
+
+  constexpr int block_bytes = 256;
+  constexpr int header_bytes = 4;
+  constexpr int block_samples = 1 + 2 * (block_bytes - header_bytes);
+
+  constexpr int16_t step_table[89] = {
+        7,     8,     9,    10,    11,    12,    13,    14,    16,    17,
+       19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
+       50,    55,    60,    66,    73,    80,    88,    97,   107,   118,
+      130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
+      337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
+      876,   963,  1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+     2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
+     5894,  6484,  7132,  7845,  8630,  9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+  };
+
+  constexpr int8_t index_table[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8
+  };
+
+  struct State {
+    int32_t predictor;
+    int index;
+
+    inline void header(const uint8_t* block) {
+      predictor = int16_t(block[0] | (block[1] << 8));
+      index = block[2] > 88 ? 88 : block[2];
+    }
+
+    inline int16_t decode(int code) {
+      int32_t step = step_table[index];
+      int32_t diff = step >> 3;
+      if (code & 1) diff += step >> 2;
+      if (code & 2) diff += step >> 1;
+      if (code & 4) diff += step;
+      predictor += (code & 8) ? -diff : diff;
+      if (predictor > 32767)        predictor = 32767;
+      else if (predictor < -32768)  predictor = -32768;
+
+      index += index_table[code];
+      if (index < 0)        index = 0;
+      else if (index > 88)  index = 88;
+      return int16_t(predictor);
+    }
+
+    inline int encode(int32_t sample) {
+      // the code that decode() will take closest to sample, and decodes it
+      int32_t step = step_table[index];
+      int32_t diff = sample - predictor;
+      int code = 0;
+      if (diff < 0) { code = 8; diff = -diff; }
+      if (diff >= step) { code |= 4; diff -= step; }
+      step >>= 1;
+      if (diff >= step) { code |= 2; diff -= step; }
+      step >>= 1;
+      if (diff >= step) { code |= 1; }
+      decode(code);
+      return code;
+    }
+  };
+
+  inline size_t blockCount(size_t samples) {
+    return (samples + block_samples - 1) / block_samples;
+  }
+
+  inline void encodeBlock(const int16_t* in, int count, State& s, uint8_t* out) {
+    // Encodes up to block_samples samples into one block. A short block is
+    // padded with its last sample. The index carries on from block to block.
+    auto at = [&](int n) { return in[n < count ? n : count - 1]; };
+
+    s.predictor = at(0);
+    out[0] = uint8_t(s.predictor);
+    out[1] = uint8_t(s.predictor >> 8);
+    out[2] = uint8_t(s.index);
+    out[3] = 0;
+
+    for (int n = 1; n < block_samples; n += 2) {
+      int lo = s.encode(at(n));
+      int hi = s.encode(at(n + 1));
+      out[header_bytes + (n - 1) / 2] = uint8_t(lo | (hi << 4));
+    }
+  }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sampleheader.h"
+
+/* A pair of samples, packed ready to flash, as host/pbox-pack writes them:
+ * a file named for the pad digit, "1.pbi" up to "5.pbi".
+ *
+ * The image is laid out as the flash is: this in the first block, where
+ * the FlashedDir goes, then the left samples, then the right, each starting
+ * on a block, as NvmManager::blockAfter() places them. All the work of
+ * making the samples (resampling, levels, loop points, encoding) is done on
+ * the host, so flashing an image is just a block copy of each side.
+ */
+
+struct BankImage {
+  static const uint32_t magic_marker = 0x49584250;    // "PBXI"
+  static const uint8_t current_version = 1;
+
+  struct Side {
+    uint32_t offset;        // from the start of the image, on a block
+    uint32_t size;          // in bytes; 0 if there are no samples
+    SampleHeader header;    // all zero if there are no samples
+  };
+
+  uint32_t magic;
+  uint8_t  version;
+  uint8_t  reserved[3];
+  uint32_t blockSize;       // what it was laid out for
+  Side     left;
+  Side     right;
+
+  bool valid(size_t fileSize, size_t block) const {
+    auto blank = [](const SampleHeader& h) {
+      const uint8_t* b = (const uint8_t*)&h;
+      for (size_t i = 0; i < sizeof(h); ++i)
+        if (b[i]) return false;
+      return true;
+    };
+    auto fits = [&](const Side& s) {
+      // NB: An empty side has an all zero header, so that the image is the
+      //     same each time it's packed.
+      return s.offset % block == 0
+        && s.offset <= fileSize && s.size <= fileSize - s.offset
+        && (s.size == 0 ? blank(s.header) : s.header.valid());
+    };
+    return magic == magic_marker && version == current_version
+      && blockSize == block && fits(left) && fits(right);
+  }
+};
+
+static_assert(sizeof(BankImage) == 76, "BankImage is stored as is");
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Block floating point: 8 bit samples, sharing a scale in each block.
+ *
+ * Each block starts with a byte giving the shift, from 0 to 8, then has
+ * block_samples signed 8 bit mantissas. A sample is its mantissa shifted up
+ * by the block's shift. So each block has 8 bits of resolution at whatever
+ * level the block is at, and a quiet passage isn't crushed to a few bits as
+ * it is in 8 bit linear.
+ *
+ * Any sample can be read without reading the ones before it in its block.
+ *
+ * The decoder is what the box runs. The encoder is here for host tools.
+ */
+
+namespace BlockFloat {
+
+  constexpr int block_bytes = 64;
+  constexpr int header_bytes = 1;
+  constexpr int block_samples = block_bytes - header_bytes;
+  constexpr int max_shift = 8;
+
+  inline size_t blockCount(size_t samples) {
+    return (samples + block_samples - 1) / block_samples;
+  }
+
+  inline void encodeBlock(const int16_t* in, int count, uint8_t* out) {
+    // Encodes up to block_samples samples into one block. A short block is
+    // padded with its last sample.
+    auto at = [&](int n) { return int32_t(in[n < count ? n : count - 1]); };
+
+    int shift = 0;
+    for (int n = 0; n < block_samples; ++n) {
+      const int32_t v = at(n);
+      while (shift < max_shift) {
+        // rounded, as the mantissa will be
+        const int32_t m = (v + ((1 << shift) >> 1)) >> shift;
+        if (-128 <= m && m <= 127) break;
+        ++shift;
+      }
+    }
+
+    out[0] = uint8_t(shift);
+    for (int n = 0; n < block_samples; ++n) {
+      int32_t m = (at(n) + ((1 << shift) >> 1)) >> shift;
+      if (m > 127) m = 127;
+      out[header_bytes + n] = uint8_t(int8_t(m));
+    }
+  }
+}
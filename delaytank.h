@@ -0,0 +1,153 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "mulaw.h"
+
+/* Storage for a delay line: a ring of samples, written one at a time, and
+ * read back at a fractional delay, interpolating between stored samples.
+ *
+ * Samples go in and come out as raw 16 bit values. Delays are in samples,
+ * with 16 fraction bits, and must be at least one sample and at most the
+ * number of samples the tank was built for.
+ *
+ * The tanks differ in how they store the samples:
+ *
+ *    FullTank      - every sample, 16 bits each
+ *    MuLawTank     - every sample, µ-law companded to 8 bits each
+ *    HalfRateTank  - every other sample (averaged in pairs), 16 bits each
+ *
+ * The last two take half the RAM of the first, at some cost in quality.
+ *
+ * Each tank keeps the position it's writing at in a Head, so that a
+ * processing loop can hold it in a local, and hand it back when done.
+ */
+
+namespace DelayTank {
+
+  inline int32_t lerp(int32_t a, int32_t b, int32_t frac16) {
+    // NB: frac is cut to 15 bits so the product fits in 32 bits
+    return a + ((b - a) * (frac16 >> 1) >> 15);
+  }
+
+  struct Linear16 {
+    using cell_t = int16_t;
+    static inline cell_t encode(int32_t v) { return cell_t(v); }
+    static inline int32_t decode(cell_t c) { return c; }
+  };
+
+  struct MuLaw8 {
+    // µ-law, on the sample's 16 bits shifted up by one: samples in the tank
+    // are never more than +/-2.0, which is +/-16384 raw.
+    // NB: µ-law values are all even, so the shift back down is exact.
+    using cell_t = uint8_t;
+    static inline cell_t encode(int32_t v) { return MuLaw::encode(v * 2); }
+    static inline int32_t decode(cell_t c) { return MuLaw::decode(c) >> 1; }
+  };
+
+
+  template<int samples, typename Codec>
+  class Ring {
+    // Every sample, stored with Codec.
+  public:
+    using cell_t = typename Codec::cell_t;
+
+    struct Head {
+      int writeP;
+    };
+
+    Ring() { clear(); }
+
+    void clear() {
+      for (auto& c : cells) c = Codec::encode(0);
+      head.writeP = 0;
+    }
+
+    inline int32_t read(const Head& h, int32_t delay) const {
+      int readP = h.writeP + (delay >> 16);
+      if (readP >= size) readP -= size;
+      return lerp(Codec::decode(cells[readP]),
+                  Codec::decode(cells[readP + 1]), delay & 0xffff);
+    }
+
+    inline void write(Head& h, int32_t v) {
+      cells[h.writeP] = Codec::encode(v);
+      if (h.writeP == 0) {
+        cells[size] = cells[0];
+        h.writeP = size;
+      }
+      h.writeP -= 1;
+    }
+
+    Head head;
+
+  private:
+    // NB: The ring is one longer than the longest delay, so that the second
+    //     cell read never lands on the one just written. One more, past the
+    //     end, mirrors cells[0], so that cell needn't wrap.
+    static constexpr int size = samples + 1;
+    cell_t cells[size + 1];
+  };
+
+  template<int samples>
+  class HalfRate {
+    // Every other sample: each cell is the average of a pair, and so sits
+    // half way between the two in time.
+  public:
+    struct Head {
+      int writeP;
+      int32_t held;   // the first sample of the pair being written
+      bool odd;       // if there is one held
+    };
+
+    HalfRate() { clear(); }
+
+    void clear() {
+      for (auto& c : cells) c = 0;
+      head.writeP = 0;
+      head.held = 0;
+      head.odd = false;
+    }
+
+    inline int32_t read(const Head& h, int32_t delay) const {
+      // The newest cell, at writeP + 1, is 1.5 samples old, or 2.5 if the
+      // first of the next pair is held. Convert to cells from there.
+      int32_t p = (delay + (h.odd ? -0x8000 : 0x8000)) >> 1;
+      if (p < 0x10000) p = 0x10000;
+      int readP = h.writeP + (p >> 16);
+      if (readP >= size) readP -= size;
+      return lerp(cells[readP], cells[readP + 1], p & 0xffff);
+    }
+
+    inline void write(Head& h, int32_t v) {
+      if (!h.odd) {
+        h.held = v;
+        h.odd = true;
+        return;
+      }
+      h.odd = false;
+      cells[h.writeP] = int16_t((h.held + v) >> 1);
+      if (h.writeP == 0) {
+        cells[size] = cells[0];
+        h.writeP = size;
+      }
+      h.writeP -= 1;
+    }
+
+    Head head;
+
+  private:
+    // NB: As with Ring, plus one more for the half cell of read offset.
+    static constexpr int size = samples / 2 + 2;
+    int16_t cells[size + 1];
+  };
+}
+
+template<int samples>
+using FullTank = DelayTank::Ring<samples, DelayTank::Linear16>;
+
+template<int samples>
+using MuLawTank = DelayTank::Ring<samples, DelayTank::MuLaw8>;
+
+template<int samples>
+using HalfRateTank = DelayTank::HalfRate<samples>;
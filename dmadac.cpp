@@ -1,23 +1,23 @@
 #include "dmadac.h"
-
-#include <Adafruit_ZeroDMA.h>
-#include <wiring_private.h> // for pinPeripheral()
+#include "swar.h"
 
 
 namespace {
   class ZeroSource : public SoundSource {
   public:
-    virtual void supply(sample_t* buffer, int count) {
+    virtual void supply(sample_t* buffer, int count, ScratchPool&) {
       while (count--)
         *buffer++ = SAMPLE_ZERO;
     }
+    virtual void supplyAdd(sample_t* buffer, int count, ScratchPool&) { }
+    virtual int scratchDepthAdd() const { return 0; }
   };
 
   ZeroSource _zeroSource;
 
   class TestRampSource : public SoundSource {
   public:
-    virtual void supply(sample_t* buffer, int count) {
+    virtual void supply(sample_t* buffer, int count, ScratchPool&) {
       using calc_t = SFixed<18,13>;
       sample_t bump(calc_t(SAMPLE_UNIT) / calc_t(count));
       sample_t s = SAMPLE_ZERO;
@@ -37,156 +37,222 @@ SoundSource& testRampSource = _testRampSource;
 
 namespace {
 
-  using dac_t = uint16_t;
-
-  constexpr int DAC_BITS = 10;           // DAC on SAM D21 is only 10 bits
-  constexpr dac_t DAC_ZERO = 1 << (DAC_BITS - 1);
-  constexpr dac_t DAC_UNIT = DAC_ZERO - 1;
-  constexpr dac_t DAC_POS_ONE = DAC_ZERO + DAC_UNIT;
-  constexpr dac_t DAC_NEG_ONE = DAC_ZERO - DAC_UNIT;
+  using DmaDac::dac_t;
 
   SoundSource* dmaSource = &zeroSource;
+  DmaDac::Output* output = nullptr;
+  int outputBits = DAC_BITS;
+
+  using DmaDac::buffer_count;
+  using DmaDac::block_step;
+  using DmaDac::ring_max;
+  using DmaDac::engine_count;
+  static_assert(buffer_count % block_step == 0
+    && block_step % (12 * ENGINE_DIVISOR) == 0);
+  static_assert(ring_max > 2, "the output holds two buffers at all times");
+
+  alignas(4) sample_t ring[ring_max][buffer_count];
+    // aligned for Swar::dacBlock()
+    // Buffers rendered ahead of the output, each of blockSize samples when
+    // it was rendered. Only depth of them are used at once: two held by the
+    // output, the rest what the render can get ahead by, to ride out a slow
+    // buffer. This costs ring_max * buffer_count * sizeof(sample_t) bytes.
+  int ringCounts[ring_max];
+  dac_t silence[buffer_count];
+    // sent in place of a buffer the render didn't get to in time
+
+  volatile int blockSize = buffer_count;
+  volatile int depth = 4;
+
+  // The ring is used in order: the render fills ring[writeIndex], then the
+  // output takes ring[readIndex]. Of the buffers, `ready` are rendered and
+  // waiting, `held` are the output's, and the rest, up to depth, are free
+  // to render into. As the ring goes round all ring_max buffers, whatever
+  // the depth, depth can change at any time.
+  int writeIndex = 0;
+  int readIndex = 0;
+  volatile int ready = 0;
+  volatile int held = 0;
+
+  int taken[2];           // ring index of what the output holds, or -1
+  int takenCount = 0;     // how many it holds: it gives one back per next()
+  int oldestTaken = 0;
+
+  using DmaDac::scratch_count;
+
+  alignas(4) sample_t scratch_buffers[scratch_count][engine_count];
+  ScratchPool scratch(scratch_buffers[0], scratch_count, engine_count);
+
+  sample_t engineBuffer[engine_count];
+    // what the graph renders into, when it runs below the DAC rate
+  Upsampler<ENGINE_DIVISOR> upsampler;
+
+  static_assert(DmaDac::ram_bytes == sizeof(ring) + sizeof(silence)
+    + sizeof(scratch_buffers) + sizeof(engineBuffer) + sizeof(upsampler),
+    "DmaDac::ram_bytes doesn't add up what's here");
+
+  inline int fillBuffer(sample_t* buf, int count) {
+    // fills buf with output values, and returns how many samples clipped
+    static_assert(sizeof(dac_t) == sizeof(sample_t),
+      "dac_t and sample_t not the same size");
+      // because a buffer of samples is converted into a buffer of dac values
+    if (ENGINE_DIVISOR == 1)
+      return dmaSource->supplyDac(buf, count, scratch, outputBits);
 
-  Adafruit_ZeroDMA dma;
-
-  const int buffer_count = 96;
-  static_assert(buffer_count % 4 == 0);
-    // must be a multiple of 4 for the 1/4 SR sample based sources to work
-
-  sample_t buffer_a[buffer_count];
-  sample_t buffer_b[buffer_count];
-  bool transferring_buffer_a;
-
-  inline void fillBuffer(sample_t* b) {
-    dmaSource->supply(b, buffer_count);
+    const int n = count / ENGINE_DIVISOR;
+    dmaSource->supply(engineBuffer, n, scratch);
+    upsampler.run(engineBuffer, n, buf);
+    return Swar::dacBlock(outputBits, buf, count);
   }
 
   volatile unsigned int dmaCount = 0;
+  volatile unsigned long dmaSamples = 0;
   volatile unsigned int dmaClipped = 0;
   volatile unsigned long dmaTime = 0;
+  volatile unsigned int dmaUnderruns = 0;
+  volatile unsigned int ringSum = 0;      // of ready, at each next()
+  volatile int ringLow = ring_max;        // lowest ready, since the report
 
-  void dmaDoneCallback(Adafruit_ZeroDMA* _dma) {
-    if (_dma != &dma) return;
-    dmaCount += 1;
-    auto t0 = micros();
 
-    sample_t* buf = transferring_buffer_a ? buffer_a : buffer_b;
-    transferring_buffer_a = !transferring_buffer_a;
-    fillBuffer(buf);
+  // Auto-tuning watches the slowest render over each window, against the
+  // time the buffer takes to play. If that's within tune_high of it, or a
+  // buffer was missed, the block grows a step. If it's under tune_low of
+  // the time a step smaller block plays, the block shrinks: the slowest
+  // render is taken to cost as much at the smaller size, as it may well
+  // mostly be per buffer overhead.
 
-    static_assert(sizeof(dac_t) == sizeof(sample_t),
-      "dac_t and sample_t not the same size");
-      // because a buffer of samples is converted into a buffer of dac values
+  volatile bool tuning = false;
+  constexpr int tune_window = int(DAC_RATE) / 4;        // in samples
+  constexpr int tune_high = 75;                         // percent
+  constexpr int tune_low = 60;
 
-    using sdac_t = SFixed<15, 16>;
-    constexpr sdac_t SDAC_MAX = sdac_t(DAC_UNIT) >> (DAC_BITS - 1);
-    constexpr sdac_t SDAC_MIN = - SDAC_MAX;
-
-    for (int i = buffer_count; i; --i, ++buf) {
-      sdac_t u(*buf);
-      dac_t v;
-      if (u > SDAC_MAX)       { v = DAC_POS_ONE; dmaClipped++; }
-      else if (u < SDAC_MIN)  { v = DAC_NEG_ONE; dmaClipped++; }
-      else
-        v = dac_t((u << (DAC_BITS - 1)) + sdac_t(DAC_ZERO));
-      *((dac_t*)buf) = v;
-    }
+  unsigned long tuneWorst = 0;
+  int tuneSamples = 0;
+  unsigned int tuneUnderruns = 0;
+
+  inline unsigned long playMicros(int count) {
+    return (unsigned long)(count * 1000000.0f / DAC_RATE);
+  }
 
-    auto t1 = micros();
-    dmaTime += t1 - t0;   // should still work if it rolls over!
+  void tune(int count, unsigned long t) {
+    if (t > tuneWorst) tuneWorst = t;
+    tuneSamples += count;
+    if (tuneSamples < tune_window) return;
+
+    const unsigned int underruns = dmaUnderruns;
+    const bool missed = underruns != tuneUnderruns;
+    int next = blockSize;
+    if (missed || tuneWorst * 100 > playMicros(next) * tune_high)
+      next += block_step;
+    else if (tuneWorst * 100 < playMicros(next - block_step) * tune_low)
+      next -= block_step;
+    blockSize = clamp(next, int(block_step), buffer_count);
+
+    tuneWorst = 0;
+    tuneSamples = 0;
+    tuneUnderruns = underruns;
   }
 }
 
 namespace DmaDac {
-  void setSource(SoundSource& s) { dmaSource = &s; }
-
-  void begin() {
-
-    // TIMER INIT ------------------------------------------------------------
-    // TC4 is used because it has a WO[] output mappable to a pin on the CPE
+  bool setSource(SoundSource& s) {
+    if (s.scratchDepth() > scratch_count) return false;
+    dmaSource = &s;
+    return true;
+  }
 
-    pinPeripheral(A7, PIO_TIMER);
+  bool setBlock(int count, int d) {
+    if (count < block_step || count > buffer_count || count % block_step)
+      return false;
+    if (d < 3 || d > ring_max)
+      return false;
+    tuning = false;
+    blockSize = count;
+    depth = d;
+    return true;
+  }
 
-    GCLK->CLKCTRL.reg = (uint16_t)(GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN_GCLK0 |
-                                  GCLK_CLKCTRL_ID(GCM_TC4_TC5));
-    while (GCLK->STATUS.bit.SYNCBUSY == 1)
-      ;
+  void autoTune(bool on) {
+    tuneWorst = 0;
+    tuneSamples = 0;
+    tuneUnderruns = dmaUnderruns;
+    tuning = on;
+  }
 
-    TC4->COUNT16.CTRLA.reg &= ~TC_CTRLA_ENABLE; // Disable TCx to config it
-    while (TC4->COUNT16.STATUS.bit.SYNCBUSY)
-      ;
+  int blockCount() { return blockSize; }
+  int ringDepth() { return depth; }
 
-    TC4->COUNT16.CTRLA.reg =     // Configure timer counter
-        TC_CTRLA_MODE_COUNT16 |  // 16-bit counter mode
-        TC_CTRLA_WAVEGEN_MFRQ |  // Match Frequency mode
-        TC_CTRLA_PRESCALER_DIV1; // 1:1 Prescale
-    while (TC4->COUNT16.STATUS.bit.SYNCBUSY)
-      ;
+  bool begin(Output& o) {
+    if (!Swar::dacWidth(o.bits())) return false;
+    output = &o;
+    outputBits = o.bits();
+    for (auto& v : silence) v = dac_t(1 << (outputBits - 1));
 
-    TC4->COUNT16.CC[0].reg = SAMPLE_RATE_CPU_DIVISOR - 1;
-    while (TC4->COUNT16.STATUS.bit.SYNCBUSY)
-      ;
+    render();
+    o.start();
+    return true;
+  }
 
-    TC4->COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE; // Re-enable TCx
-    while (TC4->COUNT16.STATUS.bit.SYNCBUSY)
-      ;
+  void render() {
+    // Called by the output below its own interrupt's priority, so nothing
+    // waits on the sound graph; it fills every free buffer before it returns.
+    while (true) {
+      noInterrupts();
+      bool room = ready + held < depth;
+      interrupts();
+      if (!room) break;
+
+      auto t0 = micros();
+
+      const int count = blockSize;
+      sample_t* buf = ring[writeIndex];
+      const int clipped = fillBuffer(buf, count);
+      dmaClipped += clipped;
+      ringCounts[writeIndex] = count;
+      writeIndex = (writeIndex + 1) % ring_max;
+
+      noInterrupts();
+      ready += 1;
+      interrupts();
+
+      auto t1 = micros();
+      dmaTime += t1 - t0;   // should still work if it rolls over!
+      if (tuning) tune(count, t1 - t0);
+    }
+  }
 
-    // DAC INIT --------------------------------------------------------------
+  const dac_t* next(int& count) {
+    // NB: The output holds two buffers: the one it's sending, and the one
+    //     it'll send next. Once it has both, each call gives back the older.
+    if (takenCount == 2) {
+      if (taken[oldestTaken] >= 0) held -= 1;
+      takenCount -= 1;
+      oldestTaken = 1 - oldestTaken;
+      dmaCount += 1;
+    }
+    const int slot = (oldestTaken + takenCount) % 2;
+    takenCount += 1;
+
+    const dac_t* buf;
+    if (ready > 0) {
+      taken[slot] = readIndex;
+      readIndex = (readIndex + 1) % ring_max;
+      ready -= 1;
+      held += 1;
+      count = ringCounts[taken[slot]];
+      buf = (const dac_t*)ring[taken[slot]];
+    }
+    else {
+      taken[slot] = -1;
+      count = blockSize;
+      buf = silence;
+      dmaUnderruns += 1;
+    }
+    dmaSamples += count;
 
-#ifdef ADAFRUIT_CIRCUITPLAYGROUND_M0
-    // pinMode(11, OUTPUT);
-    // digitalWrite(11, LOW); // Switch off speaker (DAC to A0 pin only)
-#endif
-    analogWriteResolution(DAC_BITS); // Let Arduino core initialize the DAC,
-    analogWrite(A0, DAC_ZERO);       // ain't nobody got time for that!
-    DAC->CTRLB.bit.REFSEL = 0;          // VMAX = 1.0V
-    while (DAC->STATUS.bit.SYNCBUSY)
-      ;
-
-    // DMA INIT --------------------------------------------------------------
-
-    fillBuffer(buffer_a);
-    fillBuffer(buffer_b);
-    transferring_buffer_a = true;
-
-
-    dma.allocate();
-    dma.setTrigger(TC4_DMAC_ID_OVF);
-    dma.setAction(DMA_TRIGGER_ACTON_BEAT);
-    dma.setPriority(DMA_PRIORITY_3);    // highest priority for DMAC
-
-    NVIC_SetPriority(DMAC_IRQn, 0);     // highest priority for NVIC
-    NVIC_SetPriority(PTC_IRQn, 1);      // make sure that PTC is lower
-      // must be done after Adafruit_ZeroDMA::allocate(), which sets it to 3
-    USB->DEVICE.QOSCTRL.bit.CQOS = 2;
-    USB->DEVICE.QOSCTRL.bit.DQOS = 2;
-    DMAC->QOSCTRL.bit.DQOS = 3;
-    DMAC->QOSCTRL.bit.FQOS = 3;
-    DMAC->QOSCTRL.bit.WRBQOS = 3;
-
-    auto desc1 = dma.addDescriptor(
-      buffer_a,
-      (void *)&DAC->DATABUF.reg,
-      buffer_count,
-      DMA_BEAT_SIZE_HWORD,
-      true,
-      false
-    );
-    desc1->BTCTRL.bit.BLOCKACT = DMA_BLOCK_ACTION_INT;
-
-    auto desc2 = dma.addDescriptor(
-      buffer_b,
-      (void *)&DAC->DATABUF.reg,
-      buffer_count,
-      DMA_BEAT_SIZE_HWORD,
-      true,
-      false
-    );
-    desc2->BTCTRL.bit.BLOCKACT = DMA_BLOCK_ACTION_INT;
-
-    dma.loop(true);
-    dma.setCallback(dmaDoneCallback);
-    dma.startJob();
+    ringSum += ready;
+    if (ready < ringLow) ringLow = ready;
+    return buf;
   }
 
   void report(Print& out) {
@@ -210,18 +276,44 @@ namespace DmaDac {
     unsigned long reportDmaTime = currentDmaTime - lastDmaTime;
     lastDmaTime = currentDmaTime;
 
-    float sr = float(reportDmaCount * buffer_count) * 1000000.0f / float(t);
-
-    out.printf("DMA to DAC: %d buffers sent in %7dus, %5dHz",
-        reportDmaCount, t, int(sr));
-    out.printf("   %6dµs filling buffers, %4dµs/buffer",
-        reportDmaTime, reportDmaTime / reportDmaCount);
-    out.printf("   %3d clipped samples\n", reportDmaClipped);
+    static unsigned int lastDmaUnderruns = 0;
+    unsigned int currentDmaUnderruns = dmaUnderruns;
+    unsigned int reportDmaUnderruns = currentDmaUnderruns - lastDmaUnderruns;
+    lastDmaUnderruns = currentDmaUnderruns;
+
+    static unsigned int lastRingSum = 0;
+    unsigned int currentRingSum = ringSum;
+    unsigned int reportRingSum = currentRingSum - lastRingSum;
+    lastRingSum = currentRingSum;
+
+    static unsigned long lastDmaSamples = 0;
+    unsigned long currentDmaSamples = dmaSamples;
+    unsigned long reportDmaSamples = currentDmaSamples - lastDmaSamples;
+    lastDmaSamples = currentDmaSamples;
+
+    int reportRingLow = ringLow;
+    ringLow = ring_max;
+
+    float sr = float(reportDmaSamples) * 1000000.0f / float(t);
+    if (reportDmaCount == 0) reportDmaCount = 1;    // for the averages
+
+    out.printf("%s: %u buffers sent in %7luus, %5dHz",
+        output ? output->name() : "no output", reportDmaCount, t, int(sr));
+    out.printf("   %6luµs filling buffers, %4luµs/buffer, %2lu%% load",
+        reportDmaTime, reportDmaTime / reportDmaCount,
+        t ? reportDmaTime * 100 / t : 0);
+    out.printf("   %3u clipped samples", reportDmaClipped);
+    out.printf("   %u.%u/%d ahead (low %d), %u underruns",
+        reportRingSum / reportDmaCount,
+        reportRingSum * 10 / reportDmaCount % 10,
+        depth - 2, reportRingLow, reportDmaUnderruns);
+    out.printf("   %d sample blocks%s", int(blockSize), tuning ? ", tuned" : "");
+    out.printf("   %d/%d scratch buffers\n", scratch.highWater(), scratch_count);
 
 #if 0
     sample_t buf[buffer_count];
     memcpy(buf,
-      transferring_buffer_a ? buffer_a : buffer_b,
+      ring[(readIndex + ring_max - 1) % ring_max],
       sizeof(sample_t) * buffer_count);
 
     for (int i = 0; i < buffer_count; ++i) {
@@ -8,10 +8,73 @@
 extern SoundSource& zeroSource;
 extern SoundSource& testRampSource;
 
+/* DmaDac keeps a ring of buffers rendered ahead from a SoundSource, and
+ * hands them, converted to output values, to an Output that sends them on.
+ * The ring, the pulling from the source, the conversion and the stats are
+ * all here; how the values leave the chip is the Output's business: see
+ * dmaoutput.h for the SAMD21's, and host/hostoutput.h for the host's.
+ */
+
 namespace DmaDac {
-  void begin();
-  void setSource(SoundSource&);
+  using dac_t = uint16_t;
+
+  class Output {
+  public:
+    virtual int bits() const = 0;
+      // width of the unsigned output values, centered on 1 << (bits - 1)
+    virtual const char* name() const = 0;
+    virtual void start() = 0;
+      // sets up the transport, and takes its first two buffers with next()
+  };
+
+  constexpr int buffer_count = 96;
+    // most samples supplied per DMA buffer: 2ms at 48kHz
+  constexpr int engine_count = buffer_count / ENGINE_DIVISOR;
+    // most samples the graph supplies for one, at its rate
+  constexpr int block_step = 12 * ENGINE_DIVISOR;
+    // a DMA buffer is a multiple of this, for the 1/2, 1/3, 1/4 & 1/6 SR
+    // sample based sources to work
+  constexpr int ring_max = 6;
+    // most buffers in the ring: the two the DMAC holds, plus those rendered
+    // ahead of it
+  constexpr int scratch_count = 4;
+    // Most scratch buffers a source graph may borrow at once: each MixSource
+    // whose second input can't add in place needs one while it runs.
+
+  constexpr size_t ram_bytes =
+      ring_max * buffer_count * sizeof(sample_t)          // the ring
+    + buffer_count * sizeof(dac_t)                        // the silence
+    + scratch_count * engine_count * sizeof(sample_t)     // the scratch
+    + engine_count * sizeof(sample_t)                     // the graph's
+    + sizeof(Upsampler<ENGINE_DIVISOR>);
+    // the buffers DmaDac keeps, all static: pbox.ino adds them to the
+    // graph's to check the whole fits
+
+  bool begin(Output&);
+    // false, and nothing started, if the output's bits() isn't one that
+    // Swar::withDac() converts to
+  bool setSource(SoundSource&);
+    // false if the source needs more scratch buffers than DmaDac has
   inline void clearSource() { setSource(zeroSource); }
 
+  bool setBlock(int count, int depth);
+    // samples per DMA buffer, a multiple of block_step up to buffer_count,
+    // and buffers in the ring, 3 to ring_max; false if either is out of
+    // range. This turns off autoTune().
+  void autoTune(bool on);
+    // keeps the block as small as it can be and still render with margin;
+    // a larger block costs less per sample, a smaller one is less latency
+  int blockCount();
+  int ringDepth();
+
+  const dac_t* next(int& count);
+    // The output calls this, at interrupt time, each time it finishes a
+    // buffer, for the next to send once the one it's now sending is done.
+    // The one it finished is free to render into again. The count samples
+    // are silence if the render didn't get there in time.
+  void render();
+    // Fills every free buffer in the ring. The output arranges for this to
+    // run after each next(), at a lower priority than its own interrupt.
+
   void report(Print& out);
 }
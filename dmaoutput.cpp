@@ -0,0 +1,162 @@
+#include "dmaoutput.h"
+
+#include <wiring_private.h> // for pinPeripheral()
+
+namespace {
+  DmaOutput* active = nullptr;
+
+  void startSampleTimer() {
+    // TC4 is used because it has a WO[] output mappable to a pin on the CPE
+
+    pinPeripheral(A7, PIO_TIMER);
+
+    GCLK->CLKCTRL.reg = (uint16_t)(GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN_GCLK0 |
+                                  GCLK_CLKCTRL_ID(GCM_TC4_TC5));
+    while (GCLK->STATUS.bit.SYNCBUSY == 1)
+      ;
+
+    TC4->COUNT16.CTRLA.reg &= ~TC_CTRLA_ENABLE; // Disable TCx to config it
+    while (TC4->COUNT16.STATUS.bit.SYNCBUSY)
+      ;
+
+    TC4->COUNT16.CTRLA.reg =     // Configure timer counter
+        TC_CTRLA_MODE_COUNT16 |  // 16-bit counter mode
+        TC_CTRLA_WAVEGEN_MFRQ |  // Match Frequency mode
+        TC_CTRLA_PRESCALER_DIV1; // 1:1 Prescale
+    while (TC4->COUNT16.STATUS.bit.SYNCBUSY)
+      ;
+
+    TC4->COUNT16.CC[0].reg = SAMPLE_RATE_CPU_DIVISOR - 1;
+    while (TC4->COUNT16.STATUS.bit.SYNCBUSY)
+      ;
+
+    TC4->COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE; // Re-enable TCx
+    while (TC4->COUNT16.STATUS.bit.SYNCBUSY)
+      ;
+  }
+}
+
+void DmaOutput::start() {
+  active = this;
+
+  startSampleTimer();
+  startTransport();
+
+  dma.allocate();
+  dma.setTrigger(TC4_DMAC_ID_OVF);
+  dma.setAction(DMA_TRIGGER_ACTON_BEAT);
+  dma.setPriority(DMA_PRIORITY_3);    // highest priority for DMAC
+
+  NVIC_SetPriority(DMAC_IRQn, 0);     // highest priority for NVIC
+  NVIC_SetPriority(PTC_IRQn, 1);      // make sure that PTC is lower
+    // must be done after Adafruit_ZeroDMA::allocate(), which sets it to 3
+  NVIC_SetPriority(SysTick_IRQn, 2);  // the core sets SysTick to 3,
+    // where it and PendSV couldn't preempt each other
+  NVIC_SetPriority(PendSV_IRQn, 3);   // rendering is below everything,
+    // SysTick too, so millis() keeps time through a slow render
+  USB->DEVICE.QOSCTRL.bit.CQOS = 2;
+  USB->DEVICE.QOSCTRL.bit.DQOS = 2;
+  DMAC->QOSCTRL.bit.DQOS = 3;
+  DMAC->QOSCTRL.bit.FQOS = 3;
+  DMAC->QOSCTRL.bit.WRBQOS = 3;
+
+  for (int d = 0; d < 2; ++d) {
+    int count;
+    const DmaDac::dac_t* first = DmaDac::next(count);
+    descriptors[d] = dma.addDescriptor(
+      (void *)first,
+      (void *)destination(),
+      count,
+      DMA_BEAT_SIZE_HWORD,
+      true,
+      false
+    );
+    descriptors[d]->BTCTRL.bit.BLOCKACT = DMA_BLOCK_ACTION_INT;
+  }
+  finishing = 0;
+
+  dma.loop(true);
+  dma.setCallback(dmaDoneCallback);
+  dma.startJob();
+}
+
+void DmaOutput::dmaDoneCallback(Adafruit_ZeroDMA* _dma) {
+  if (active && _dma == &active->dma) active->done();
+}
+
+void DmaOutput::done() {
+  // NB: The DMAC has already loaded the other descriptor, and is sending
+  //     its buffer, so the one that finished can be repointed: it'll be
+  //     sent a buffer's time from now.
+  int d = finishing;
+  finishing = 1 - d;
+
+  int count;
+  const DmaDac::dac_t* next = DmaDac::next(count);
+  dma.changeDescriptor(descriptors[d],
+    (void *)next, (void *)destination(), count);
+
+  SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;   // render into what was freed
+}
+
+extern "C" void PendSV_Handler() {
+  DmaDac::render();
+}
+
+
+void DacOutput::startTransport() {
+#ifdef ADAFRUIT_CIRCUITPLAYGROUND_M0
+  // pinMode(11, OUTPUT);
+  // digitalWrite(11, LOW); // Switch off speaker (DAC to A0 pin only)
+#endif
+  analogWriteResolution(DAC_BITS); // Let Arduino core initialize the DAC,
+  analogWrite(A0, 1 << (DAC_BITS - 1));   // ain't nobody got time for that!
+  DAC->CTRLB.bit.REFSEL = 0;          // VMAX = 1.0V
+  while (DAC->STATUS.bit.SYNCBUSY)
+    ;
+}
+
+volatile void* DacOutput::destination() const {
+  return &DAC->DATABUF.reg;
+}
+
+
+void PwmOutput::startTransport() {
+  // TCC1 runs free on its own period; the DMAC writes CCB[1] at DAC_RATE,
+  // which the TCC takes up at its next period. In DITH4 mode the low 4 bits
+  // of CC and PER are the dither, so an output value goes into CCB as is.
+
+  // NB: A3 as it's free: pbox.ino has pads on A1 & A2, and TC4 takes A7.
+  pinPeripheral(A3, PIO_TIMER);     // PA07: TCC1/WO[1]
+
+  GCLK->CLKCTRL.reg = (uint16_t)(GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN_GCLK0 |
+                                GCLK_CLKCTRL_ID(GCM_TCC0_TCC1));
+  while (GCLK->STATUS.bit.SYNCBUSY == 1)
+    ;
+
+  TCC1->CTRLA.reg &= ~TCC_CTRLA_ENABLE;
+  while (TCC1->SYNCBUSY.bit.ENABLE)
+    ;
+
+  TCC1->CTRLA.reg =
+      TCC_CTRLA_RESOLUTION_DITH4 |
+      TCC_CTRLA_PRESCALER_DIV1;
+  TCC1->WAVE.reg = TCC_WAVE_WAVEGEN_NPWM;
+  while (TCC1->SYNCBUSY.bit.WAVE)
+    ;
+
+  TCC1->PER.reg = (256 - 1) << 4;   // 48MHz / 256 = 187.5kHz
+  while (TCC1->SYNCBUSY.bit.PER)
+    ;
+  TCC1->CC[1].reg = 1 << (bits() - 1);
+  while (TCC1->SYNCBUSY.bit.CC1)
+    ;
+
+  TCC1->CTRLA.reg |= TCC_CTRLA_ENABLE;
+  while (TCC1->SYNCBUSY.bit.ENABLE)
+    ;
+}
+
+volatile void* PwmOutput::destination() const {
+  return &TCC1->CCB[1].reg;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <Adafruit_ZeroDMA.h>
+
+#include "dmadac.h"
+
+/* The SAMD21's outputs for DmaDac. Each sends the buffers with the DMAC,
+ * one value each tick of TC4, at DAC_RATE, over a pair of descriptors that
+ * loop, repointing each as it finishes. Rendering runs in PendSV, below
+ * every other interrupt.
+ */
+
+class DmaOutput : public DmaDac::Output {
+public:
+  virtual void start();
+
+protected:
+  virtual void startTransport() = 0;
+  virtual volatile void* destination() const = 0;
+
+private:
+  static void dmaDoneCallback(Adafruit_ZeroDMA*);
+  void done();
+
+  Adafruit_ZeroDMA dma;
+  DmacDescriptor* descriptors[2];
+  int finishing = 0;    // which descriptor will finish next
+};
+
+class DacOutput : public DmaOutput {
+  // the DAC, on A0: 10 bits, to the speaker amp as well
+public:
+  virtual int bits() const { return DAC_BITS; }
+  virtual const char* name() const { return "DMA to DAC"; }
+
+protected:
+  virtual void startTransport();
+  virtual volatile void* destination() const;
+};
+
+class PwmOutput : public DmaOutput {
+  // TCC1 PWM, on A3: 12 bits, as 8 bits of PWM at 187.5kHz, with the TCC's
+  // 4 bits of dithering over each 16 periods. Needs an RC low-pass on the
+  // pin (1k & 10nF is about right), as the dithering adds tones at
+  // multiples of 11.7kHz.
+public:
+  virtual int bits() const { return 12; }
+  virtual const char* name() const { return "DMA to PWM"; }
+
+protected:
+  virtual void startTransport();
+  virtual volatile void* destination() const;
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+// Host stand-in for the Arduino core: just enough for the audio engine.
+
+#include <alloca.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef F_CPU
+#define F_CPU 48000000L
+#endif
+
+#ifndef PI
+#define PI 3.1415926535897932384626433832795
+#endif
+
+#define NVMCTRL_ROW_SIZE 256    // the SAMD21's, for nvmmanager.h's blocks
+
+template<class T, class L>
+auto min(const T& a, const L& b) -> decltype((b < a) ? b : a)
+  { return (b < a) ? b : a; }
+
+template<class T, class L>
+auto max(const T& a, const L& b) -> decltype((b < a) ? b : a)
+  { return (a < b) ? b : a; }
+
+unsigned long micros();
+unsigned long millis();
+
+// Nothing on the host interrupts: HostOutput calls DmaDac in turn.
+inline void noInterrupts() { }
+inline void interrupts() { }
@@ -0,0 +1,163 @@
+#pragma once
+
+// Host stand-in for the FixedPoints library (Pharap/FixedPointsArduino).
+//
+// Only the parts of the API that the sketch uses are here.  Arithmetic is
+// done the way the library does it: same sized operands multiply in a type
+// twice as wide and shift back, mixed sized operands are first converted to
+// the larger of the two, and conversions between types shift the raw value.
+
+#include <stdint.h>
+#include <type_traits>
+
+#include "Arduino.h"
+
+namespace FixedPointsHost {
+
+  template<unsigned bits, bool sgn>
+  struct Least {
+    using type =
+      typename std::conditional<bits <= 8,  std::conditional_t<sgn, int8_t,  uint8_t>,
+      typename std::conditional<bits <= 16, std::conditional_t<sgn, int16_t, uint16_t>,
+      typename std::conditional<bits <= 32, std::conditional_t<sgn, int32_t, uint32_t>,
+                                            std::conditional_t<sgn, int64_t, uint64_t>
+      >::type>::type>::type;
+  };
+
+  template<typename T>
+  using EnableArith =
+    typename std::enable_if<std::is_arithmetic<T>::value>::type;
+
+
+  template<unsigned Integer, unsigned Fraction, bool Signed>
+  class Fixed {
+  public:
+    static constexpr unsigned IntegerSize = Integer;
+    static constexpr unsigned FractionSize = Fraction;
+    static constexpr unsigned LogicalSize = Integer + Fraction + Signed;
+
+    using InternalType = typename Least<LogicalSize, Signed>::type;
+    using PrecisionType = typename Least<LogicalSize * 2, Signed>::type;
+    using IntegerType = typename Least<Integer + Signed, Signed>::type;
+
+    static constexpr unsigned InternalSize = sizeof(InternalType) * 8;
+    static constexpr double Scale = double(uint64_t(1) << Fraction);
+
+    constexpr Fixed() : value(0) { }
+
+    template<typename T, typename = EnableArith<T>>
+    constexpr Fixed(const T& v) : value(fromArith(v)) { }
+
+    template<unsigned I2, unsigned F2, bool S2>
+    constexpr explicit Fixed(const Fixed<I2, F2, S2>& o)
+      : value(shiftRaw<F2>(o.getInternal())) { }
+
+    static constexpr Fixed fromInternal(InternalType raw) {
+      Fixed f;
+      f.value = raw;
+      return f;
+    }
+    constexpr InternalType getInternal() const { return value; }
+    constexpr IntegerType getInteger() const {
+      return IntegerType(value >> Fraction);
+    }
+
+    template<typename T, typename = EnableArith<T>>
+    constexpr explicit operator T() const {
+      return std::is_floating_point<T>::value
+        ? T(double(value) / Scale)
+        : T(value >> Fraction);
+    }
+
+    Fixed& operator+=(const Fixed& o) { value += o.value; return *this; }
+    Fixed& operator-=(const Fixed& o) { value -= o.value; return *this; }
+    Fixed& operator*=(const Fixed& o) { value = mul(value, o.value); return *this; }
+    Fixed& operator/=(const Fixed& o) { value = div(value, o.value); return *this; }
+
+    friend constexpr Fixed operator+(const Fixed& a, const Fixed& b)
+      { return fromInternal(InternalType(a.value + b.value)); }
+    friend constexpr Fixed operator-(const Fixed& a, const Fixed& b)
+      { return fromInternal(InternalType(a.value - b.value)); }
+    friend constexpr Fixed operator*(const Fixed& a, const Fixed& b)
+      { return fromInternal(mul(a.value, b.value)); }
+    friend constexpr Fixed operator/(const Fixed& a, const Fixed& b)
+      { return fromInternal(div(a.value, b.value)); }
+    friend constexpr Fixed operator-(const Fixed& a)
+      { return fromInternal(InternalType(-a.value)); }
+    friend constexpr Fixed operator<<(const Fixed& a, unsigned n)
+      { return fromInternal(InternalType(a.value * (PrecisionType(1) << n))); }
+    friend constexpr Fixed operator>>(const Fixed& a, unsigned n)
+      { return fromInternal(InternalType(a.value >> n)); }
+
+    friend constexpr bool operator==(const Fixed& a, const Fixed& b)
+      { return a.value == b.value; }
+    friend constexpr bool operator!=(const Fixed& a, const Fixed& b)
+      { return a.value != b.value; }
+    friend constexpr bool operator<(const Fixed& a, const Fixed& b)
+      { return a.value < b.value; }
+    friend constexpr bool operator>(const Fixed& a, const Fixed& b)
+      { return a.value > b.value; }
+    friend constexpr bool operator<=(const Fixed& a, const Fixed& b)
+      { return a.value <= b.value; }
+    friend constexpr bool operator>=(const Fixed& a, const Fixed& b)
+      { return a.value >= b.value; }
+
+  private:
+    template<typename T>
+    static constexpr InternalType fromArith(const T& v) {
+      return std::is_floating_point<T>::value
+        ? InternalType(double(v) * Scale)
+        : InternalType(PrecisionType(v) * (PrecisionType(1) << Fraction));
+    }
+
+    template<unsigned F2, typename R>
+    static constexpr InternalType shiftRaw(R raw) {
+      using Wide = std::conditional_t<std::is_signed<R>::value, int64_t, uint64_t>;
+      return InternalType(Fraction >= F2
+        ? Wide(raw) * (Wide(1) << (Fraction >= F2 ? Fraction - F2 : 0))
+        : Wide(raw) >> (Fraction >= F2 ? 0 : F2 - Fraction));
+    }
+
+    static constexpr InternalType mul(InternalType a, InternalType b) {
+      return InternalType((PrecisionType(a) * PrecisionType(b)) >> Fraction);
+    }
+    static constexpr InternalType div(InternalType a, InternalType b) {
+      return InternalType(
+        PrecisionType(a) * (PrecisionType(1) << Fraction) / PrecisionType(b));
+    }
+
+    InternalType value;
+  };
+
+
+  template<typename A, typename B>
+  using Larger = std::conditional_t<(A::LogicalSize >= B::LogicalSize), A, B>;
+
+  template<typename A, typename B>
+  using EnableMixed = typename std::enable_if<!std::is_same<A, B>::value>::type;
+
+#define FIXED_POINTS_HOST_MIXED_OP(op)                                         \
+  template<unsigned I1, unsigned F1, unsigned I2, unsigned F2, bool S,         \
+    typename A = Fixed<I1, F1, S>, typename B = Fixed<I2, F2, S>,              \
+    typename = EnableMixed<A, B>>                                              \
+  constexpr auto operator op(const Fixed<I1, F1, S>& a,                        \
+                             const Fixed<I2, F2, S>& b) {                      \
+    using C = Larger<A, B>;                                                    \
+    return C(a) op C(b);                                                       \
+  }
+
+  FIXED_POINTS_HOST_MIXED_OP(+)
+  FIXED_POINTS_HOST_MIXED_OP(-)
+  FIXED_POINTS_HOST_MIXED_OP(*)
+  FIXED_POINTS_HOST_MIXED_OP(/)
+  FIXED_POINTS_HOST_MIXED_OP(<)
+  FIXED_POINTS_HOST_MIXED_OP(>)
+
+#undef FIXED_POINTS_HOST_MIXED_OP
+}
+
+template<unsigned Integer, unsigned Fraction>
+using SFixed = FixedPointsHost::Fixed<Integer, Fraction, true>;
+
+template<unsigned Integer, unsigned Fraction>
+using UFixed = FixedPointsHost::Fixed<Integer, Fraction, false>;
@@ -0,0 +1,31 @@
+#pragma once
+
+// Host stand-in for the Arduino core's Print, as DmaDac::report() uses it.
+
+#include <stdarg.h>
+#include <stdio.h>
+
+class Print {
+public:
+  virtual ~Print() { }
+  virtual size_t write(const char* s, size_t n) = 0;
+
+  size_t printf(const char* format, ...)
+    __attribute__((format(printf, 2, 3))) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+    if (n < 0) return 0;
+    return write(buf, n < int(sizeof(buf)) ? size_t(n) : sizeof(buf) - 1);
+  }
+  size_t println() { return write("\n", 1); }
+};
+
+class StdoutPrint : public Print {
+public:
+  virtual size_t write(const char* s, size_t n) {
+    return fwrite(s, 1, n, stdout);
+  }
+};
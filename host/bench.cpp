@@ -0,0 +1,1673 @@
+// pbox-bench: renders the pbox.ino sound chain offline, on the host,
+// and reports how long each node in the chain takes.
+//
+//    pbox-bench [-o out.wav] [-t seconds] [-c ref.wav] [-d dmadac.wav] [-p]
+//               [left.raw [right.raw]]
+//
+// The .raw files are the same 24k8.raw files the box plays. Without them, a
+// pair of synthetic samples is used: a short kick, and a long (looped) pad.
+//
+// The chain is also played through DmaDac itself, into a HostOutput, which
+// -d writes out as DAC values; -p paces that to real time, as on the box.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "dmadac.h"
+#include "hostoutput.h"
+#include "sound.h"
+#include "swar.h"
+#include "types.h"
+#include "wavfile.h"
+
+namespace {
+
+  const int file_sample_rate = 24000;   // as in pbox.ino
+  const int voices_per_pad = 2;         // as in pbox.ino
+  const int buffer_count = 96 / ENGINE_DIVISOR;
+                                        // as engine_count in dmadac.cpp
+  const int block_step = 12;            // at the engine rate, as in dmadac.cpp
+  const int scratch_count = 4;          // as in dmadac.cpp
+
+  sample_t scratch_buffers[scratch_count][buffer_count];
+  ScratchPool scratch(scratch_buffers[0], scratch_count, buffer_count);
+
+  uint64_t nowNs() {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(
+      steady_clock::now().time_since_epoch()).count();
+  }
+
+  uint64_t nowCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return nowNs();
+#endif
+  }
+
+
+  /***
+   *** Probes time a node, excluding the time spent in the nodes it pulls from
+   ***/
+
+  class Probe : public SoundSource {
+  public:
+    Probe(const char* _name, SoundSource& _node)
+      : name(_name), node(_node)
+      { }
+
+    virtual void supply(sample_t* buffer, int count, ScratchPool& scratch) {
+      time(&SoundSource::supply, buffer, count, scratch);
+    }
+    virtual void supplyAdd(sample_t* buffer, int count, ScratchPool& scratch) {
+      time(&SoundSource::supplyAdd, buffer, count, scratch);
+    }
+    virtual int scratchDepth() const    { return node.scratchDepth(); }
+    virtual int scratchDepthAdd() const { return node.scratchDepthAdd(); }
+
+    void report() const {
+      double nsPerSample = double(ns) / double(samples);
+      printf("  %-12s %8ld calls %9.2f ns/sample %12.0f samples/s"
+        " %8.1f cycles/sample\n",
+        name, calls, nsPerSample, 1e9 / nsPerSample,
+        double(cycles) / double(samples));
+    }
+
+    const char* name;
+    uint64_t ns = 0;
+    uint64_t cycles = 0;
+    long samples = 0;
+    long calls = 0;
+
+  private:
+    SoundSource& node;
+    uint64_t inner = 0;
+    uint64_t innerCycles = 0;
+
+    using supply_fn = void (SoundSource::*)(sample_t*, int, ScratchPool&);
+
+    void time(supply_fn fn, sample_t* buffer, int count, ScratchPool& scratch) {
+      Probe* outer = current;
+      current = this;
+      uint64_t innerBefore = inner;
+      uint64_t innerCyclesBefore = innerCycles;
+      inner = 0;
+      innerCycles = 0;
+
+      uint64_t c0 = nowCycles();
+      uint64_t t0 = nowNs();
+      (node.*fn)(buffer, count, scratch);
+      uint64_t t = nowNs() - t0;
+      uint64_t c = nowCycles() - c0;
+
+      ns += t - inner;
+      cycles += c - innerCycles;
+      inner = innerBefore;
+      innerCycles = innerCyclesBefore;
+      current = outer;
+      if (outer) {
+        outer->inner += t;
+        outer->innerCycles += c;
+      }
+
+      samples += count;
+      calls += 1;
+    }
+
+    static Probe* current;
+  };
+
+  Probe* Probe::current = nullptr;
+
+
+  /***
+   *** Sample data
+   ***/
+
+  using file_sample_t = Samples::sample_t::InternalType;
+
+  std::vector<file_sample_t> readRaw(const char* path) {
+    std::vector<file_sample_t> data;
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+      fprintf(stderr, "can't open %s\n", path);
+      exit(1);
+    }
+    int c;
+    while ((c = fgetc(f)) != EOF) data.push_back(file_sample_t(c));
+    fclose(f);
+    return data;
+  }
+
+  std::vector<file_sample_t> synthKick() {
+    std::vector<file_sample_t> data(file_sample_rate / 4);
+    double phase = 0;
+    for (size_t i = 0; i < data.size(); ++i) {
+      double t = double(i) / file_sample_rate;
+      phase += 2 * M_PI * (50.0 + 100.0 * exp(-t * 30.0)) / file_sample_rate;
+      data[i] = file_sample_t(120.0 * exp(-t * 12.0) * sin(phase));
+    }
+    return data;
+  }
+
+  template<typename T>
+  std::vector<T> synthPadAt(double fullScale) {
+    std::vector<T> data(file_sample_rate * 3 / 4);
+    uint32_t noise = 12345;
+    for (size_t i = 0; i < data.size(); ++i) {
+      double t = double(i) / file_sample_rate;
+      noise = noise * 1664525 + 1013904223;
+      double v = 0.4 * sin(2 * M_PI * 220.0 * t)
+               + 0.3 * sin(2 * M_PI * 331.0 * t)
+               + 0.1 * (int32_t(noise) / 2147483648.0);
+      data[i] = T(fullScale * v);
+    }
+    return data;
+  }
+
+  std::vector<file_sample_t> synthPad() {
+    return synthPadAt<file_sample_t>(120.0);
+  }
+
+
+  /***
+   *** The performance: what loop() in pbox.ino would do, in a fixed pattern
+   ***/
+
+  const char* pattern1 = "x...x...x..xx...";
+  const char* pattern2 = "..x...x...x...x.";
+  const float stepTime = 0.125f;    // 16th notes at 120bpm
+  const float holdTime = 0.060f;
+  const float accelPeriod = 0.100f;
+
+  template<typename Gate>
+  void perform(Gate& gate, const char* pattern, float t, float amp) {
+    int step = int(t / stepTime);
+    float into = t - step * stepTime;
+    if (pattern[step % 16] == 'x' && into < holdTime) gate.gate(amp);
+    else                                              gate.gateOff();
+  }
+
+  /***
+   *** Interpolation kernels, timed on their own
+   ***/
+
+  template<int factor, template<int> class Kernel>
+  double timeKernel(const std::vector<file_sample_t>& data) {
+    SampleGateSource<int(SAMPLE_RATE) / factor, Kernel> gate;
+    gate.load(Samples((void*)data.data(), data.size()));
+    gate.gate(0.9f);
+
+    sample_t buffer[buffer_count];
+    const int blocks = 20000;
+    uint64_t t0 = nowNs();
+    for (int i = 0; i < blocks; ++i)
+      gate.supply(buffer, buffer_count, scratch);
+    return double(nowNs() - t0) / double(blocks * buffer_count);
+  }
+
+  template<int factor>
+  void reportKernels(const std::vector<file_sample_t>& data) {
+    printf("  1/%d rate %11.2f %11.2f %11.2f\n", factor,
+      timeKernel<factor, ZeroOrderKernel>(data),
+      timeKernel<factor, LinearKernel>(data),
+      timeKernel<factor, CubicKernel>(data));
+  }
+
+  void reportAllKernels(const std::vector<file_sample_t>& pad) {
+    std::vector<file_sample_t> data;
+    while (data.size() < size_t(SAMPLE_RATE))
+      data.insert(data.end(), pad.begin(), pad.end());
+      // long enough to loop at every rate
+
+    printf("interpolation kernels, ns/sample:\n");
+    printf("  %-9s %11s %11s %11s\n", "", "zero-order", "linear", "cubic");
+    reportKernels<1>(data);
+    reportKernels<2>(data);
+    reportKernels<3>(data);
+    reportKernels<4>(data);
+    reportKernels<6>(data);
+  }
+
+
+  /***
+   *** Playing at any rate
+   ***/
+
+  // A 1kHz tone, at the file's rate, played by VarRateGateSource. The
+  // output is compared with the tone computed directly at the output rate,
+  // at the position the voice steps to, so the error is what the
+  // interpolator adds. The frequency is measured from the phase of the
+  // output over a second.
+
+  template<typename Interp>
+  void reportVarRate(const char* name, int rate, float pitch) {
+    const double freq = 1000.0;
+    const double level = 0.5;
+    std::vector<int16_t> tone(rate * 2);
+    for (size_t i = 0; i < tone.size(); ++i)
+      tone[i] = int16_t(32767.0 * level * sin(2 * M_PI * freq * i / rate));
+
+    VarRateGateSource<Interp> voice;
+    voice.setRate(rate);
+    voice.setPitch(pitch);
+    voice.load(Samples(tone.data(), tone.size() * 2, Samples::linear16));
+    const double amp = 0.9;
+    voice.gate(amp);
+
+    const int blocks = int(SAMPLE_RATE) / buffer_count;   // about a second
+    std::vector<sample_t> out(blocks * buffer_count);
+    uint64_t c0 = nowCycles();
+    for (int b = 0; b < blocks; ++b)
+      voice.supply(&out[b * buffer_count], buffer_count, scratch);
+    const double cycles = double(nowCycles() - c0) / double(out.size());
+
+    // skip the attack, then compare, and fit the phase
+    const double step = double(voice.step()) / (1 << voice.frac_bits);
+    const double want = freq * step / (double(rate) / SAMPLE_RATE);
+    double sig = 0, err = 0, re = 0, im = 0, re0 = 0, im0 = 0;
+    const size_t skip = size_t(SAMPLE_RATE / 10);
+    const size_t half = skip + (out.size() - skip) / 2;
+    for (size_t j = skip; j < out.size(); ++j) {
+      const double v = double(out[j].getInternal()) / (1 << 13);
+      const double ideal =
+        amp * level * sin(2 * M_PI * freq * j * step / rate);
+      sig += ideal * ideal;
+      err += (v - ideal) * (v - ideal);
+
+      const double w = 2 * M_PI * want * j / SAMPLE_RATE;
+      if (j < half) { re0 += v * cos(w); im0 += v * sin(w); }
+      else          { re += v * cos(w);  im += v * sin(w); }
+    }
+    // the phase drift between the halves gives the frequency error
+    double drift = atan2(im, re) - atan2(im0, re0);
+    while (drift > M_PI) drift -= 2 * M_PI;
+    while (drift < -M_PI) drift += 2 * M_PI;
+    const double halfSecs = double(out.size() - skip) / 2 / SAMPLE_RATE;
+    const double measured = want - drift / (2 * M_PI * halfSecs);
+
+    printf("  %-6s %6dHz x%.3f %6.1f cycles/sample %7.1f dB error,"
+      " %9.3fHz for %9.3fHz\n",
+      name, rate, pitch, cycles, 10 * log10(err / sig),
+      measured, freq * pitch);
+  }
+
+  void reportVarRates() {
+    printf("variable rate voice, a 1kHz tone:\n");
+    for (int rate : { 12000, 22050, 24000, 32000, 44100 }) {
+      reportVarRate<FracLinear>("linear", rate, 1.0f);
+      reportVarRate<FracCubic>("cubic", rate, 1.0f);
+    }
+    reportVarRate<FracLinear>("linear", 22050, 1.5f);
+    reportVarRate<FracCubic>("cubic", 22050, 1.5f);
+  }
+
+
+  /***
+   *** Granular voice: its cost, against a gate voice, and the grains it plays
+   ***/
+
+  void reportGranular(const std::vector<file_sample_t>& pad) {
+    const Samples s(pad.data(), pad.size());
+    const int blocks = 2 * int(SAMPLE_RATE) / buffer_count;   // two seconds
+    std::vector<sample_t> out(blocks * buffer_count);
+
+    auto run = [&](SoundSource& voice) {
+      uint64_t c0 = nowCycles();
+      for (int b = 0; b < blocks; ++b)
+        voice.supply(&out[b * buffer_count], buffer_count, scratch);
+      return double(nowCycles() - c0) / double(out.size());
+    };
+    auto peakDb = [&]() {
+      int peak = 1;
+      for (auto v : out) peak = std::max(peak, std::abs(int(v.getInternal())));
+      return 20 * log10(double(peak) / (1 << 13));
+    };
+
+    printf("granular voice, the pad, %d grains of %dms:\n",
+      GranularSourceBase::max_grains, GranularSourceBase::grain_ms);
+    {
+      SampleGateSource<file_sample_rate> voice;
+      voice.load(s);
+      voice.gate(0.9f);
+      const double cycles = run(voice);
+      printf("  %-16s %6.1f cycles/sample %6.1fdB peak\n",
+        "gate voice", cycles, peakDb());
+    }
+    for (float speed : { 0.0f, 0.5f, 1.0f }) {
+      GranularSource<file_sample_rate> voice;
+      voice.load(s);
+      voice.setPosition(0.3f);
+      voice.setSpeed(speed);
+      voice.gate(0.9f);
+      const double cycles = run(voice);
+      const double secs = double(out.size()) / SAMPLE_RATE;
+      printf("  %-6s at x%.1f  %6.1f cycles/sample %6.1fdB peak,"
+        " %5.1f grains/s, %lu dropped\n",
+        speed == 0.0f ? "frozen" : "moving", speed, cycles, peakDb(),
+        voice.grainsStarted() / secs, voice.grainsDropped());
+    }
+  }
+
+
+  /***
+   *** Sample formats: the cost of decoding, and what it does to the sound
+   ***/
+
+  // The pad is made at 16 bits, then stored both ways, at the same sample
+  // rate: as linear8 (truncated, as a .raw export would be), and as IMA
+  // ADPCM. Each is compared against the 16 bit original.
+
+  std::vector<uint8_t> encodeAdpcm(const std::vector<int16_t>& in) {
+    const size_t blocks = ImaAdpcm::blockCount(in.size());
+    std::vector<uint8_t> out(blocks * ImaAdpcm::block_bytes);
+    ImaAdpcm::State s = { 0, 0 };
+    for (size_t b = 0; b < blocks; ++b) {
+      const size_t first = b * ImaAdpcm::block_samples;
+      ImaAdpcm::encodeBlock(in.data() + first,
+        int(std::min(in.size() - first, size_t(ImaAdpcm::block_samples))),
+        s, out.data() + b * ImaAdpcm::block_bytes);
+    }
+    return out;
+  }
+
+  void reportFormat(const char* name, const Samples& samples,
+    const std::vector<int16_t>& original, size_t bytes)
+  {
+    const int count = int(original.size());
+    std::vector<int16_t> decoded(count);
+
+    SampleReader reader;
+    reader.start(samples, 0, true);
+    reader.read(decoded.data(), count);
+
+    double sig = 0, err = 0;
+    for (int i = 0; i < count; ++i) {
+      double d = double(decoded[i]) - double(original[i]);
+      sig += double(original[i]) * double(original[i]);
+      err += d * d;
+    }
+
+    // decode cost, on its own, in runs as the gate voices read them
+    const int chunk = 32;
+    const int runs = 200000;
+    int16_t out[chunk];
+    reader.start(samples, 0, true);
+    uint64_t c0 = nowCycles();
+    for (int i = 0; i < runs; ++i)
+      reader.read(out, chunk);
+    double decodeCycles = double(nowCycles() - c0) / double(runs * chunk)
+      * file_sample_rate / SAMPLE_RATE;   // per output sample
+
+    // and as part of a whole gate voice
+    SampleGateSource<file_sample_rate> gate;
+    gate.load(samples);
+    gate.gate(0.9f);
+    sample_t buffer[buffer_count];
+    const int blocks = 20000;
+    c0 = nowCycles();
+    for (int i = 0; i < blocks; ++i)
+      gate.supply(buffer, buffer_count, scratch);
+    double voiceCycles = double(nowCycles() - c0) / double(blocks * buffer_count);
+
+    char snr[16];
+    if (err > 0)  snprintf(snr, sizeof(snr), "%6.1f dB", 10 * log10(sig / err));
+    else          snprintf(snr, sizeof(snr), "%9s", "exact");
+
+    printf("    %-9s %6.0f bytes/s %s SNR, per output sample: %5.1f cycles"
+      " decoding, %5.1f cycles in a gate voice\n",
+      name, double(bytes) * file_sample_rate / count,
+      snr, decodeCycles, voiceCycles);
+  }
+
+  void reportFormats(double level) {
+    // level is the pad's full scale, in dB below the loudest 8 bits can take
+    std::vector<int16_t> pad =
+      synthPadAt<int16_t>(120.0 * 256 * pow(10.0, level / 20.0));
+
+    std::vector<file_sample_t> pad8(pad.size());
+    for (size_t i = 0; i < pad.size(); ++i)
+      pad8[i] = file_sample_t(pad[i] >> 8);
+
+    std::vector<uint8_t> padAdpcm = encodeAdpcm(pad);
+
+    std::vector<uint8_t> padMuLaw(pad.size());
+    for (size_t i = 0; i < pad.size(); ++i)
+      padMuLaw[i] = MuLaw::encode(pad[i]);
+
+    const size_t bfpBlocks = BlockFloat::blockCount(pad.size());
+    std::vector<uint8_t> padBfp(bfpBlocks * BlockFloat::block_bytes);
+    for (size_t b = 0; b < bfpBlocks; ++b) {
+      const size_t first = b * BlockFloat::block_samples;
+      BlockFloat::encodeBlock(pad.data() + first,
+        int(std::min(pad.size() - first, size_t(BlockFloat::block_samples))),
+        padBfp.data() + b * BlockFloat::block_bytes);
+    }
+
+    printf("  at %.0f dB:\n", level);
+    reportFormat("linear8",
+      Samples(pad8.data(), pad8.size(), Samples::linear8),
+      pad, pad8.size());
+    reportFormat("linear16",
+      Samples(pad.data(), pad.size() * 2, Samples::linear16),
+      pad, pad.size() * 2);
+    reportFormat("mu-law",
+      Samples(padMuLaw.data(), padMuLaw.size(), Samples::muLaw8),
+      pad, padMuLaw.size());
+    reportFormat("bfp8",
+      Samples(padBfp.data(), padBfp.size(), Samples::blockFloat8),
+      pad, padBfp.size());
+    reportFormat("ima-adpcm",
+      Samples(padAdpcm.data(), padAdpcm.size(), Samples::imaAdpcm),
+      pad, padAdpcm.size());
+  }
+
+
+  /***
+   *** Streaming, from a file read by loop() between DMA buffers
+   ***/
+
+  // The file is in memory, but fill() is only called every so often, as
+  // loop() would call it, to see how long loop() can be away before the
+  // ring runs dry.
+
+  struct MemFile {
+    // the parts of FatFile that SampleStream uses
+    const std::vector<uint8_t>& bytes;
+    size_t pos;
+
+    MemFile(const std::vector<uint8_t>& b) : bytes(b), pos(0) { }
+
+    int read(void* buf, size_t n) {
+      n = std::min(n, bytes.size() - pos);
+      memcpy(buf, bytes.data() + pos, n);
+      pos += n;
+      return int(n);
+    }
+    bool seekSet(uint32_t p) { pos = std::min(size_t(p), bytes.size()); return true; }
+  };
+
+  bool checkStreaming(const std::vector<file_sample_t>& pad) {
+    // ten seconds of the pad, at 16 bits
+    std::vector<uint8_t> bytes;
+    while (bytes.size() < size_t(10 * file_sample_rate * 2))
+      for (auto v : pad) {
+        int16_t w = int16_t(v * 256);
+        bytes.push_back(uint8_t(w));
+        bytes.push_back(uint8_t(w >> 8));
+      }
+    const int blocks = int(bytes.size() / 2 * (SAMPLE_RATE / file_sample_rate))
+      / buffer_count;
+
+    // the same samples from flash, to check the streamed output against
+    SampleSource<file_sample_rate> flashed;
+    flashed.load(Samples(bytes.data(), bytes.size(), Samples::linear16));
+    flashed.play(0.9f);
+
+    SampleStream stream;
+    StreamSource<file_sample_rate> voice(stream);
+    voice.setAmp(0.9f);
+    MemFile file(bytes);
+
+    sample_t want[buffer_count], got[buffer_count];
+    bool same = true;
+    stream.start(file, Samples::linear16);
+    for (int i = 0; i < blocks; ++i) {
+      flashed.supply(want, buffer_count, scratch);
+      voice.supply(got, buffer_count, scratch);
+      same = same && memcmp(want, got, sizeof(want)) == 0;
+      stream.fill(file);
+    }
+    printf("  streamed output %s the output from flash\n",
+      same ? "matches" : "DIFFERS from");
+
+    const float blockMs = 1000.0f * buffer_count / SAMPLE_RATE;
+    printf("  ring of %d blocks of %d bytes, %.1fms of 16 bit samples:\n",
+      SampleStream::slots, SampleStream::block_bytes,
+      1000.0f * SampleStream::slots * SampleStream::block_bytes / 2
+        / file_sample_rate);
+    for (int periodMs : { 2, 10, 20, 30, 40, 60 }) {
+      const int every = std::max(1, int(periodMs / blockMs + 0.5f));
+      uint64_t supplyCycles = 0, fillNs = 0;
+      int fills = 0;
+
+      stream.resetStats();
+      stream.start(file, Samples::linear16);
+      for (int i = 0; i < blocks; ++i) {
+        uint64_t c0 = nowCycles();
+        voice.supply(got, buffer_count, scratch);
+        supplyCycles += nowCycles() - c0;
+        if (i % every == every - 1) {
+          uint64_t t0 = nowNs();
+          stream.fill(file);
+          fillNs += nowNs() - t0;
+          fills += 1;
+        }
+      }
+      printf("    loop() every %2dms: %4lu underruns, %6.1fms missed,"
+        " low water %d, %5.1f cycles/sample, %6.0f ns/fill\n",
+        periodMs, stream.underruns(),
+        1000.0 * stream.samplesMissed() / file_sample_rate, stream.lowWater(),
+        double(supplyCycles) / double(blocks * buffer_count),
+        double(fillNs) / std::max(fills, 1));
+    }
+    return same;
+  }
+
+  bool checkHeads(const std::vector<file_sample_t>& pad) {
+    // a second of the pad, at 16 bits, as a file, and its head
+    std::vector<uint8_t> bytes;
+    while (bytes.size() < size_t(file_sample_rate * 2))
+      for (auto v : pad) {
+        int16_t w = int16_t(v * 256);
+        bytes.push_back(uint8_t(w));
+        bytes.push_back(uint8_t(w >> 8));
+      }
+    const float blockMs = 1000.0f * buffer_count / SAMPLE_RATE;
+    const float streamBlockMs =
+      1000.0f * SampleStream::block_bytes / 2 / file_sample_rate;
+
+    SampleStream stream;
+    StreamSource<file_sample_rate> voice(stream);
+    voice.setAmp(0.9f);
+    MemFile file(bytes);
+    sample_t want[buffer_count], got[buffer_count];
+
+    // spliced, it should be just as if played from flash
+    {
+      const size_t headBytes = 2 * SampleStream::block_bytes;
+      SampleSource<file_sample_rate> flashed;
+      flashed.load(Samples(bytes.data(), bytes.size(), Samples::linear16));
+      flashed.play(0.9f);
+
+      stream.start(Samples(bytes.data(), headBytes, Samples::linear16), true);
+      file.seekSet(headBytes);
+      bool same = true;
+      const int blocks = int(bytes.size() / 2 * (SAMPLE_RATE / file_sample_rate))
+        / buffer_count;
+      for (int i = 0; i < blocks; ++i) {
+        flashed.supply(want, buffer_count, scratch);
+        voice.supply(got, buffer_count, scratch);
+        same = same && memcmp(want, got, sizeof(want)) == 0;
+        stream.fill(file);
+      }
+      printf("  spliced output %s the output from flash\n",
+        same ? "matches" : "DIFFERS from");
+      if (!same) return false;
+    }
+
+    // A new sample every 250ms, for 20s. After each, loop() is away for
+    // openMs opening the file, then fills every 10ms.
+    const int loopEvery = std::max(1, int(10.0f / blockMs + 0.5f));
+    const int hitEvery = int(250.0f / blockMs);
+    const int blocks = int(20.0f * 1000.0f / blockMs);
+    printf("  head cache, a hit every 250ms, loop() every 10ms,"
+      " late tails of %d:\n", blocks / hitEvery);
+    printf("    %-14s", "file open in");
+    for (int openMs : { 5, 10, 20, 40 }) printf(" %5dms", openMs);
+    printf("\n");
+
+    for (int headBlocks : { 1, 2, 4, 8 }) {
+      const size_t headBytes = headBlocks * SampleStream::block_bytes;
+      const Samples head(bytes.data(), headBytes, Samples::linear16);
+      printf("    %4.0fms head:  ", headBlocks * streamBlockMs);
+
+      for (int openMs : { 5, 10, 20, 40 }) {
+        const int openBlocks = int(openMs / blockMs + 0.5f);
+        stream.resetStats();
+        int opened = -1;    // block the file is open at, once hit
+        for (int i = 0; i < blocks; ++i) {
+          if (i % hitEvery == 0) {
+            stream.start(head, true);
+            opened = i + openBlocks;
+          }
+          voice.supply(got, buffer_count, scratch);
+          if (opened >= 0 && i >= opened) {
+            file.seekSet(headBytes);
+            opened = -1;
+          }
+          if (opened < 0 && i % loopEvery == loopEvery - 1)
+            stream.fill(file);
+        }
+        printf(" %7lu", stream.tailsLate());
+      }
+      printf("\n");
+    }
+    return true;
+  }
+
+
+  /***
+   *** Sample headers: loop points and gain
+   ***/
+
+  bool checkHeaders(const std::vector<file_sample_t>& pad) {
+    // a second of the pad, at 16 bits
+    std::vector<uint8_t> bytes;
+    while (bytes.size() < size_t(file_sample_rate * 2))
+      for (auto v : pad) {
+        int16_t w = int16_t(v * 256);
+        bytes.push_back(uint8_t(w));
+        bytes.push_back(uint8_t(w >> 8));
+      }
+    const Samples s(bytes.data(), bytes.size(), Samples::linear16);
+    const int factor = SAMPLE_RATE / file_sample_rate;
+    const int blocks = 2 * SAMPLE_RATE / buffer_count;
+
+    auto render = [&](const SampleHeader& h) {
+      SampleGateSource<file_sample_rate> voice;
+      voice.load(s, h);
+      voice.gate(0.9f);
+      std::vector<sample_t> out(blocks * buffer_count);
+      for (int i = 0; i < blocks; ++i)
+        voice.supply(&out[i * buffer_count], buffer_count, scratch);
+      return out;
+    };
+
+    SampleHeader h = SampleHeader::defaults(s.format(), file_sample_rate,
+      s.length());
+    h.loopStart = file_sample_rate / 5;
+    h.loopEnd = file_sample_rate * 7 / 10;
+    const auto looped = render(h);
+
+    // past the first time through, it repeats every loopEnd - loopStart
+    const int period = (h.loopEnd - h.loopStart) * factor;
+    bool periodic = true;
+    for (size_t t = h.loopEnd * factor; t + period < looped.size(); ++t)
+      periodic = periodic && looped[t] == looped[t + period];
+    printf("  looped from %dms to %dms: %s\n",
+      int(1000 * h.loopStart / file_sample_rate),
+      int(1000 * h.loopEnd / file_sample_rate),
+      periodic ? "repeats" : "DOESN'T repeat");
+
+    // half gain is half the output, to within the last bit
+    const auto full = render(h);
+    h.gain = 1 << (SampleHeader::gain_bits - 1);
+    const auto half = render(h);
+    bool halved = true;
+    for (size_t t = 0; t < full.size(); ++t)
+      halved = halved
+        && std::abs(full[t].getInternal() / 2 - half[t].getInternal()) <= 1;
+    printf("  half gain %s the output\n", halved ? "halves" : "DOESN'T halve");
+
+    return periodic && halved;
+  }
+
+
+  /***
+   *** Clicks: at loop seams, and where a retrigger starts
+   ***/
+
+  float clickEnergy(const std::vector<sample_t>& out, size_t from, size_t to) {
+    // mean square of the second difference: a step or a kink in the
+    // waveform shows up in it, a low tone hardly at all
+    double e = 0;
+    for (size_t t = std::max(from, size_t(2)); t < to; ++t) {
+      const double d = double(out[t].getInternal())
+        - 2.0 * out[t - 1].getInternal() + out[t - 2].getInternal();
+      e += d * d;
+    }
+    return float(e / (to - from));
+  }
+
+  float clickDb(float e, float steady) {
+    return 10.0f * log10f(std::max(e, 1e-9f) / steady);
+  }
+
+  float bankSwapDb(float amp, float& riseDb) {
+    // a pad playing one low tone, loaded with another mid-note, as the
+    // sample finder would; riseDb is how far the output's peak after the
+    // load goes over its peak before it
+    auto tone = [](double freq) {
+      std::vector<uint8_t> bytes;
+      for (int i = 0; i < file_sample_rate; ++i) {
+        const int16_t w = int16_t(
+          12000.0 * sin(2 * M_PI * freq * i / file_sample_rate));
+        bytes.push_back(uint8_t(w));
+        bytes.push_back(uint8_t(w >> 8));
+      }
+      return bytes;
+    };
+    const auto a = tone(220.0);
+    const auto b = tone(331.0);
+
+    SamplePad<file_sample_rate, voices_per_pad> pad;
+    pad.load(Samples(a.data(), a.size(), Samples::linear16));
+    pad.gate(amp);
+
+    const int blocks = SAMPLE_RATE / 2 / buffer_count;
+    std::vector<sample_t> out(2 * blocks * buffer_count);
+    for (int i = 0; i < 2 * blocks; ++i) {
+      if (i == blocks)
+        pad.load(Samples(b.data(), b.size(), Samples::linear16));
+      pad.supply(&out[i * buffer_count], buffer_count, scratch);
+    }
+
+    const size_t at = size_t(blocks) * buffer_count;
+    auto peak = [&](size_t from, size_t to) {
+      int p = 0;
+      for (size_t t = from; t < to; ++t)
+        p = std::max(p, std::abs(int(out[t].getInternal())));
+      return float(p);
+    };
+    riseDb = 20.0f * log10f(peak(at, out.size()) / peak(at / 2, at));
+
+    // NB: over the whole block the load is faded in, and past its end,
+    //     where the new samples start
+    const size_t near = SAMPLE_RATE / 1000;
+    const float steady = clickEnergy(out, at / 2, at - near);
+    return clickDb(
+      clickEnergy(out, at - near, at + buffer_count + near), steady);
+  }
+
+  bool checkSettle() {
+    // a second load, on a sounding voice, with nothing rendering to take
+    // the first up, as if DmaDac had stopped
+    std::vector<uint8_t> bytes(4 * file_sample_rate / 10, 0x40);
+    const Samples s(bytes.data(), bytes.size(), Samples::linear16);
+    SampleGateSource<file_sample_rate> voice;
+    voice.load(s);
+    voice.gate(0.9f);
+    sample_t out[buffer_count];
+    voice.supply(out, buffer_count, scratch);
+
+    const unsigned long t0 = millis();
+    voice.load(s);
+    voice.load(s);
+    const unsigned long ms = millis() - t0;
+    printf("  second load, not rendering: taken up after %lums\n", ms);
+    return ms < 200;
+  }
+
+  bool checkClicks() {
+    // a second of two low tones, at 16 bits: no noise to hide a click in
+    std::vector<uint8_t> bytes;
+    for (int i = 0; i < file_sample_rate; ++i) {
+      const double t = double(i) / file_sample_rate;
+      const int16_t w = int16_t(12000.0 * (0.4 * sin(2 * M_PI * 220.0 * t)
+        + 0.3 * sin(2 * M_PI * 331.0 * t)));
+      bytes.push_back(uint8_t(w));
+      bytes.push_back(uint8_t(w >> 8));
+    }
+    const Samples s(bytes.data(), bytes.size(), Samples::linear16);
+    const int factor = SAMPLE_RATE / file_sample_rate;
+    const size_t near = SAMPLE_RATE / 1000;     // 1ms either side
+
+    SampleHeader h = SampleHeader::defaults(s.format(), file_sample_rate,
+      s.length());
+    h.loopStart = file_sample_rate / 5;
+    h.loopEnd = file_sample_rate * 7 / 10 + 37;   // not on a cycle of either
+
+    auto render = [&](SampleGateSource<file_sample_rate>& voice, int blocks) {
+      std::vector<sample_t> out(blocks * buffer_count);
+      for (int i = 0; i < blocks; ++i)
+        voice.supply(&out[i * buffer_count], buffer_count, scratch);
+      return out;
+    };
+
+    SampleCues cues;
+    float seamDb[2], startDb[2];
+    for (int spliced = 0; spliced < 2; ++spliced) {
+      SampleGateSource<file_sample_rate> voice;
+      if (spliced) {
+        cues.build(s, h);
+        voice.load(s, h, &cues);
+      }
+      else
+        voice.load(s, h);
+
+      // the seams, averaged over several times round the loop
+      voice.gate(0.9f);
+      const auto out = render(voice, 3 * SAMPLE_RATE / buffer_count);
+      // NB: before any seam, or the splice, so the same for both
+      const float steady = clickEnergy(out, SAMPLE_RATE / 10,
+        size_t(h.loopEnd - SampleCues::splice_max) * factor);
+      const int to = spliced ? cues.resume.next : int(h.loopStart);
+      const size_t period = size_t(h.loopEnd - to) * factor;
+      float e = 0;
+      int seams = 0;
+      for (size_t t = size_t(h.loopEnd) * factor; t + near < out.size();
+          t += period, ++seams)
+        e += clickEnergy(out, t - near, t + near);
+      seamDb[spliced] = clickDb(e / seams, steady);
+
+      // the first 2ms of a retrigger, from positions all along the loop
+      const int positions = 16;
+      e = 0;
+      for (int i = 0; i < positions; ++i) {
+        voice.setPosition((i + 0.5f) / positions);
+        voice.retrigger(0.9f);
+        const auto hit = render(voice, 1);
+        e += clickEnergy(hit, 0, 2 * near);
+      }
+      startDb[spliced] = clickDb(e / positions, steady);
+    }
+
+    printf("  %-26s %8s %8s\n", "click energy, vs steady", "plain", "cued");
+    printf("  %-26s %6.1fdB %6.1fdB\n", "loop seam", seamDb[0], seamDb[1]);
+    printf("  %-26s %6.1fdB %6.1fdB\n", "retrigger start",
+      startDb[0], startDb[1]);
+    // NB: Both levels, as an amp of 0.5 or more is the top bit of amp_t.
+    float riseDb[2];
+    const float swapDb = bankSwapDb(0.9f, riseDb[0]);
+    bankSwapDb(0.3f, riseDb[1]);
+    printf("  %-26s %8s %6.1fdB\n", "pad loaded mid-note", "", swapDb);
+    printf("  %-26s %6.2fdB %6.2fdB  (at 0.9, at 0.3)\n",
+      "  peak after, vs before", riseDb[0], riseDb[1]);
+    printf("  splice of %d samples, starts snapped to zero crossings,"
+      " loads faded over a block\n", cues.spliceLength);
+    return seamDb[1] < seamDb[0] && startDb[1] < startDb[0]
+      && swapDb < seamDb[0] && riseDb[0] <= 0.05f && riseDb[1] <= 0.05f;
+  }
+
+
+  /***
+   *** Delay tank reads, under a chorus-like sweep of the delay time
+   ***/
+
+  // The sweep mirrors DelaySource. The "modulo" read is the one DelaySource
+  // had before it kept a wrapped ring: it truncates the delay to whole
+  // samples. The others are the tanks from delaytank.h.
+
+  const int max_delay_samples = int(0.150 * SAMPLE_RATE);
+  using delay_t = SFixed<15,16>;
+
+  struct ModuloTank {
+    std::vector<sample_t> cells;
+    int writeP;
+
+    void clear() {
+      cells.assign(max_delay_samples, sample_t(0));
+      writeP = 0;
+    }
+    sample_t read(delay_t d) {
+      int readP = writeP + int(d);
+      return cells[readP % max_delay_samples];
+    }
+    void write(sample_t w) {
+      cells[writeP] = w;
+      writeP = (writeP > 0 ? writeP : max_delay_samples) - 1;
+    }
+    int bytes() const { return max_delay_samples * sizeof(sample_t); }
+  };
+
+  template<template<int> class Tank>
+  struct TankOf {
+    Tank<max_delay_samples> tank;
+    typename Tank<max_delay_samples>::Head head;
+
+    void clear() { tank.clear(); head = tank.head; }
+    sample_t read(delay_t d) {
+      return sample_t::fromInternal(tank.read(head, d.getInternal()));
+    }
+    void write(sample_t w) { tank.write(head, w.getInternal()); }
+    int bytes() const { return sizeof(tank); }
+  };
+
+  template<typename T>
+  void timeDelayRead(const char* name) {
+    const double tone = 1000.0;
+    const double baseDelay = 0.080 * SAMPLE_RATE;
+    const double depth = 0.004 * SAMPLE_RATE;
+    const double rate = 0.7;
+    const int count = 4 * int(SAMPLE_RATE);
+
+    static T tank;
+    std::vector<sample_t> in(count), out(count);
+    std::vector<delay_t> delays(count);
+    for (int i = 0; i < count; ++i) {
+      in[i] = sample_t(float(0.5 * sin(2 * PI * tone * i / SAMPLE_RATE)));
+      delays[i] = delay_t(baseDelay + depth * sin(2 * PI * rate * i / SAMPLE_RATE));
+    }
+
+    double cycles = 0;
+    for (int pass = 0; pass < 2; ++pass) {   // the first warms the caches
+      tank.clear();
+      uint64_t c0 = nowCycles();
+      for (int i = 0; i < count; ++i) {
+        out[i] = tank.read(delays[i]);
+        tank.write(in[i]);
+      }
+      cycles = double(nowCycles() - c0) / count;
+    }
+
+    // error against the tone read at the exact, continuous, delay
+    double err = 0, sig = 0;
+    for (int i = int(0.2 * SAMPLE_RATE); i < count; ++i) {
+      double t = (i - double(delays[i])) / SAMPLE_RATE;
+      double ideal = 0.5 * sin(2 * PI * tone * t);
+      double e = double(float(out[i])) - ideal;
+      err += e * e;
+      sig += ideal * ideal;
+    }
+    printf("  %-9s %6d bytes %6.1f cycles/sample %7.1f dB error\n",
+      name, tank.bytes(), cycles, 10 * log10(err / sig));
+  }
+
+  void reportDelayReads() {
+    printf("delay tanks, 1kHz tone through a swept delay:\n");
+    timeDelayRead<ModuloTank>("modulo");
+    timeDelayRead<TankOf<FullTank>>("full");
+    timeDelayRead<TankOf<MuLawTank>>("mu-law");
+    timeDelayRead<TankOf<HalfRateTank>>("half-rate");
+  }
+
+
+  /***
+   *** The filter, across the range the accelerometer sweeps
+   ***/
+
+  class BufferSource : public SoundSource {
+    // plays a vector of samples, then silence
+  public:
+    BufferSource(const std::vector<sample_t>& d) : data(d), pos(0) { }
+
+    virtual void supply(sample_t* buffer, int count, ScratchPool&) {
+      for (; count--; ++buffer)
+        *buffer = pos < data.size() ? data[pos++] : sample_t(0);
+    }
+
+  private:
+    const std::vector<sample_t>& data;
+    size_t pos;
+  };
+
+  const float filterFreqLo = 30.0f;
+  const float filterFreqHi =                      // as pbox.ino maps it,
+    min(30.0f * expf(5.0f), 0.99f * FilterSource::freqMax);
+    // but below the filter's top, and off a whole fraction of the rate, so
+    // the peak of the samples of a sine there comes near the sine's
+
+  std::vector<sample_t> noise(int count, float amp) {
+    std::vector<sample_t> v;
+    uint32_t r = 12345;
+    while (count--) {
+      r = r * 1664525 + 1013904223;
+      v.push_back(sample_t(amp * (float(int32_t(r) >> 16) / 32768.0f)));
+    }
+    return v;
+  }
+
+  int32_t peakOf(FilterSource& filt, int count, int skip) {
+    // runs the filter for count samples, and returns the peak raw output
+    // after the first skip samples
+    sample_t buffer[buffer_count];
+    int32_t peak = 0;
+    for (int n = 0; n < count; n += buffer_count) {
+      filt.supply(buffer, buffer_count, scratch);
+      if (n >= skip)
+        for (auto s : buffer)
+          peak = max(peak, abs(int32_t(s.getInternal())));
+    }
+    return peak;
+  }
+
+  bool checkFilter() {
+    const int rate = int(SAMPLE_RATE);
+    const char* modeNames[] = { "low", "band", "high" };
+    const float qs[] = { 0.0f, 0.55f, 0.9f };
+    const int freqs = 12;
+
+    std::vector<sample_t> burst = noise(rate / 2, 0.5f);
+    std::vector<sample_t> swept = noise(4 * rate, 0.5f);
+
+    bool ok = true;
+    for (int m = 0; m < 3; ++m) {
+      auto mode = FilterSource::Mode(m);
+      int settings = 0, stable = 0;
+      double worstGain = 0;
+
+      for (float q : qs) {
+        for (int i = 0; i < freqs; ++i) {
+          float freq = filterFreqLo * powf(filterFreqHi / filterFreqLo,
+            float(i) / (freqs - 1));
+          settings += 1;
+
+          // after a burst of noise, the output must die away
+          BufferSource noiseIn(burst);
+          FilterSource filt(noiseIn);
+          filt.setMode(mode);
+          filt.setFreqAndQ(freq, q);
+          peakOf(filt, rate / 2, 0);
+          if (peakOf(filt, rate, rate - rate / 100) <= 8) stable += 1;
+
+          // a sine at the cutoff should come through at Q, in every mode
+          std::vector<sample_t> sine;
+          for (int n = 0; n < rate; ++n)
+            sine.push_back(sample_t(float(0.1 * sin(2 * PI * freq * n / rate))));
+          BufferSource sineIn(sine);
+          FilterSource filtSine(sineIn);
+          filtSine.setMode(mode);
+          filtSine.setFreqAndQ(freq, q);
+          double peak = peakOf(filtSine, rate, rate / 2)
+            / double(1 << sample_t::FractionSize);
+          double expected = 0.1 / (2.0 - 2.0 * q);
+          worstGain = max(worstGain, fabs(20 * log10(peak / expected)));
+        }
+      }
+
+      // swept fast, up and back every half second, at the highest q
+      BufferSource sweptIn(swept);
+      FilterSource filt(sweptIn);
+      filt.setMode(mode);
+      sample_t buffer[buffer_count];
+      int32_t peak = 0;
+      uint64_t c0 = nowCycles();
+      for (int n = 0; n < int(swept.size()); n += buffer_count) {
+        float phase = fmodf(float(n) / (rate / 2), 2.0f);
+        float t = phase < 1.0f ? phase : 2.0f - phase;
+        filt.setFreqAndQ(filterFreqLo * powf(filterFreqHi / filterFreqLo, t),
+          0.9f);
+        filt.supply(buffer, buffer_count, scratch);
+        for (auto s : buffer)
+          peak = max(peak, abs(int32_t(s.getInternal())));
+      }
+      double cycles = double(nowCycles() - c0) / double(swept.size());
+      bool sweptOk = peak < 32767 && peakOf(filt, rate, rate - rate / 100) <= 8;
+
+      printf("  %-5s %6.1f cycles/sample swept, stable at %d of %d settings%s,"
+        " gain at cutoff within %.2f dB\n",
+        modeNames[m], cycles, stable, settings,
+        sweptOk ? " and swept" : ", NOT when swept", worstGain);
+      ok = ok && sweptOk && stable == settings && worstGain < 0.5;
+    }
+    return ok;
+  }
+
+
+  /***
+   *** SWAR kernels, checked against the scalar reference, and timed
+   ***/
+
+  const int dac_bits = 10;    // as in dmadac.cpp
+
+  template<typename F>
+  double timeBlocks(std::vector<sample_t>& v, F f) {
+    uint64_t t0 = nowNs();
+    for (size_t i = 0; i + buffer_count <= v.size(); i += buffer_count)
+      f(&v[i], buffer_count);
+    return double(nowNs() - t0) / double(v.size());
+  }
+
+  bool checkSwar() {
+    // every sample value, in each lane, then random values
+    std::vector<sample_t> a, b;
+    for (int i = 0; i < 0x10000; ++i)
+      a.push_back(sample_t::fromInternal(int16_t(i)));
+    for (int i = 0; i < 0x10000; ++i)
+      a.push_back(sample_t::fromInternal(int16_t(i * 7919)));
+    uint32_t r = 1;
+    while (a.size() % buffer_count || a.size() < 0x40000) {
+      r = r * 1664525 + 1013904223;
+      a.push_back(sample_t::fromInternal(int16_t(r >> 16)));
+    }
+    for (size_t i = 0; i < a.size(); ++i)
+      b.push_back(a[(i * 4099 + 1) % a.size()]);
+
+    bool ok = true;
+    auto check = [&](const char* name,
+        const std::vector<sample_t>& x, const std::vector<sample_t>& y,
+        double nsSwar, double nsScalar)
+    {
+      bool same = memcmp(x.data(), y.data(), x.size() * sizeof(sample_t)) == 0;
+      ok = ok && same;
+      printf("  %-6s %-10s %6.2f ns/sample SWAR, %6.2f scalar\n",
+        name, same ? "bit-exact" : "DIFFERENT", nsSwar, nsScalar);
+    };
+
+    std::vector<sample_t> x = a, y = a;
+    double tx = timeBlocks(x, [&](sample_t* p, int n)
+      { Swar::addBlock(p, &b[p - x.data()], n); });
+    double ty = timeBlocks(y, [&](sample_t* p, int n)
+      { Swar::Scalar::addBlock(p, &b[p - y.data()], n); });
+    check("add", x, y, tx, ty);
+
+    for (float g : { 0.0f, 0.33f, -0.7f, 1.0f, 1.999f, -2.0f }) {
+      x = a; y = a;
+      tx = timeBlocks(x, [&](sample_t* p, int n)
+        { Swar::scaleBlock(p, sample_t(g), n); });
+      ty = timeBlocks(y, [&](sample_t* p, int n)
+        { Swar::Scalar::scaleBlock(p, sample_t(g), n); });
+      char name[16];
+      snprintf(name, sizeof(name), "x%g", g);
+      check(name, x, y, tx, ty);
+    }
+
+    int cx = 0, cy = 0;
+    x = a; y = a;
+    tx = timeBlocks(x, [&](sample_t* p, int n)
+      { cx += Swar::dacBlock<dac_bits>(p, n); });
+    ty = timeBlocks(y, [&](sample_t* p, int n)
+      { cy += Swar::Scalar::dacBlock<dac_bits>(p, n); });
+    check("dac", x, y, tx, ty);
+    if (cx != cy) {
+      printf("  dac clip counts DIFFER: %d SWAR, %d scalar\n", cx, cy);
+      ok = false;
+    }
+
+    return ok;
+  }
+
+
+  /***
+   *** The chain from pbox.ino, with a probe after each node
+   ***/
+
+  template<template<int> class Tank = FullTank>
+  struct Rig {
+    Rig(std::vector<file_sample_t>& left, std::vector<file_sample_t>& right)
+      : gate1P("gate1", gate1), gate2P("gate2", gate2),
+        backing(backingStream),
+        padMix(gate1P, gate2P), mix(padMix, backing), mixP("mix", mix),
+        filt(mixP), filtP("filt", filt),
+        delayPedal(filtP), delayPedalP("delayPedal", delayPedal),
+        fusedChain(mixP, filt, delayPedal)
+    {
+      gate1.load(Samples(left.data(), left.size()));
+      gate2.load(Samples(right.data(), right.size()));
+    }
+
+    SamplePad<file_sample_rate, voices_per_pad> gate1;
+    SamplePad<file_sample_rate, voices_per_pad> gate2;
+    Probe gate1P;
+    Probe gate2P;
+    SampleStream backingStream;               // never started here
+    StreamSource<file_sample_rate> backing;
+    MixSource padMix;
+    MixSource mix;
+    Probe mixP;
+    FilterSource filt;
+    Probe filtP;
+    DelaySource<Tank> delayPedal;
+    Probe delayPedalP;
+
+    Chain<buffer_count, Probe, FilterSource, DelaySource<Tank>> fusedChain;
+    Upsampler<ENGINE_DIVISOR> upsampler;      // as in dmadac.cpp
+  };
+
+  template<typename Rig>
+  void performAt(Rig& rig, float t, float& nextAccel) {
+    // the pads' patterns, and the tilts, as they'd be played at time t
+    perform(rig.gate1, pattern1, t, 0.9f);
+    perform(rig.gate2, pattern2, t, 0.6f);
+
+    if (t >= nextAccel) {
+      nextAccel += accelPeriod;
+
+      // slow tilts, standing in for the accelerometer
+      float x = 5.0f * sinf(t * 0.7f);
+      float y = -2.75f + 6.25f * sinf(t * 0.3f);
+      float z = 9.0f * cosf(t * 0.2f);
+
+      rig.filt.setFreqAndQ(
+        30.0f * expf(map_range(y, -9.0f, 3.5f, 0.0f, 5.0f)), 0.55f);
+
+      float g = map_range_clamped(x, -5.0f, 5.0f, 0.0f, 1.0f);
+      rig.gate1.setPosition(g);
+      rig.gate2.setPosition(g);
+
+      rig.delayPedal.setDelayMod(map_range(x, 8.0f, -8.0f,
+          DelaySourceBase::minMod, DelaySourceBase::maxMod));
+
+      float k = 9.0f - z;
+      k = 324.0f - k * k;
+      rig.delayPedal.setFeedback(
+        map_range_clamped(k, 0.0f, 324.0f, 0.0f, 0.980f));
+    }
+  }
+
+  template<typename Rig>
+  uint64_t render(Rig& rig, SoundSource& chainOut, long totalSamples,
+    std::vector<int16_t>& pcm, int block = buffer_count)
+  {
+    pcm.reserve((totalSamples + buffer_count) * ENGINE_DIVISOR);
+
+    alignas(4) sample_t buffer[buffer_count];     // for supplyDac()
+    sample_t dacBuffer[buffer_count * ENGINE_DIVISOR];
+    float nextAccel = 0.0f;
+    uint64_t chainNs = 0;
+
+    for (long n = 0; n < totalSamples; n += block) {
+      float t = float(n) / SAMPLE_RATE;
+
+      performAt(rig, t, nextAccel);
+
+      uint64_t t0 = nowNs();
+      chainOut.supply(buffer, block, scratch);
+      const sample_t* out = buffer;
+      if (ENGINE_DIVISOR > 1) {
+        rig.upsampler.run(buffer, block, dacBuffer);
+        out = dacBuffer;
+      }
+      chainNs += nowNs() - t0;
+
+      for (int i = 0; i < block * ENGINE_DIVISOR; ++i) {
+        const sample_t s = out[i];
+        constexpr int32_t lim = 1 << sample_t::FractionSize;
+        int32_t v = clamp(int32_t(s.getInternal()), -lim, lim - 1);
+        pcm.push_back(int16_t(v << (15 - sample_t::FractionSize)));
+      }
+    }
+
+    return chainNs;
+  }
+
+  class DacOut : public SoundSource {
+    // The graph's output as DmaDac takes it, as DAC values, turned back into
+    // samples to be written out. Fused, the Chain converts in its own loop;
+    // otherwise, it's converted in a second pass, as any other source is.
+  public:
+    DacOut(SoundSource& n, bool f) : node(n), fused(f) { }
+
+    virtual void supply(sample_t* buffer, int count, ScratchPool& scratch) {
+      uint64_t t0 = nowNs();
+      if (fused)
+        clipped += node.supplyDac(buffer, count, scratch);
+      else {
+        node.supply(buffer, count, scratch);
+        clipped += Swar::dacBlock<DAC_BITS>(buffer, count);
+      }
+      ns += nowNs() - t0;
+
+      using Dac = Swar::Dac<DAC_BITS>;
+      const uint16_t* d = (const uint16_t*)buffer;
+      for (int i = 0; i < count; ++i)
+        buffer[i] = sample_t::fromInternal(
+          int16_t((int32_t(d[i]) - Dac::zero) << Dac::shift));
+    }
+
+    uint64_t ns = 0;
+    long clipped = 0;
+
+  private:
+    SoundSource& node;
+    bool fused;
+  };
+
+  bool checkDacChain(
+    std::vector<file_sample_t>& left, std::vector<file_sample_t>& right,
+    long totalSamples)
+  {
+    Rig<> twoPass(left, right);
+    Rig<> onePass(left, right);
+    DacOut twoPassOut(twoPass.fusedChain, false);
+    DacOut onePassOut(onePass.fusedChain, true);
+    std::vector<int16_t> pcmTwo, pcmOne;
+    render(twoPass, twoPassOut, totalSamples, pcmTwo);
+    render(onePass, onePassOut, totalSamples, pcmOne);
+
+    const bool same = pcmTwo == pcmOne
+      && twoPassOut.clipped == onePassOut.clipped;
+    const double n = double(totalSamples);
+    printf("  converted in a second pass: %6.2f ns/sample\n",
+      double(twoPassOut.ns) / n);
+    printf("  converted in the chain:     %6.2f ns/sample, %s,"
+      " %ld samples clipped\n",
+      double(onePassOut.ns) / n, same ? "bit-exact" : "DIFFERENT",
+      onePassOut.clipped);
+    return same;
+  }
+
+  template<typename Rig>
+  class Performer : public SoundSource {
+    // The chain, with the playing done as each block is rendered, rather
+    // than before render() asks for it, so DmaDac can pull on it as it
+    // would on the box.
+  public:
+    Performer(Rig& r, SoundSource& c) : rig(r), chainOut(c) { }
+
+    virtual void supply(sample_t* buffer, int count, ScratchPool& scratch) {
+      play(count);
+      chainOut.supply(buffer, count, scratch);
+    }
+    virtual int supplyDac(sample_t* buffer, int count, ScratchPool& scratch,
+      int dac_bits)
+    {
+      play(count);
+      return chainOut.supplyDac(buffer, count, scratch, dac_bits);
+    }
+    virtual int scratchDepth() const { return chainOut.scratchDepth(); }
+
+  private:
+    void play(int count) {
+      performAt(rig, float(n) / SAMPLE_RATE, nextAccel);
+      n += count;
+    }
+
+    Rig& rig;
+    SoundSource& chainOut;
+    long n = 0;
+    float nextAccel = 0.0f;
+  };
+
+  class NullPrint : public Print {
+  public:
+    virtual size_t write(const char*, size_t n) { return n; }
+  };
+
+  bool checkHostOutput(
+    std::vector<file_sample_t>& left, std::vector<file_sample_t>& right,
+    const std::vector<int16_t>& pcmFused, bool realTime, const char* path)
+  {
+    // DmaDac itself, ring, render and all, into a HostOutput, against the
+    // fused render converted to DAC values
+    Rig<> rig(left, right);
+    Performer<Rig<>> performer(rig, rig.fusedChain);
+    HostOutput out(true);
+
+    NullPrint none;
+    DmaDac::report(none);     // to start its interval here
+    if (!DmaDac::setSource(performer)
+        || !DmaDac::setBlock(DmaDac::buffer_count, 4)) {
+      printf("  couldn't set up DmaDac\n");
+      return false;
+    }
+    struct OddOutput : public HostOutput {
+      OddOutput() : HostOutput(false) { }
+      virtual int bits() const { return 11; }
+    } odd;
+    if (DmaDac::begin(odd)) {
+      printf("  DmaDac took an 11 bit output\n");
+      return false;
+    }
+    if (!DmaDac::begin(out)) {
+      printf("  DmaDac refused the output's width\n");
+      return false;
+    }
+    out.run(long(pcmFused.size()), realTime);
+    printf("  ");
+    StdoutPrint stdoutPrint;
+    DmaDac::report(stdoutPrint);
+
+    using Dac = Swar::Dac<DAC_BITS>;
+    const auto& v = out.values();
+    bool same = v.size() >= pcmFused.size();
+    int clipped = 0;
+    for (size_t i = 0; same && i < pcmFused.size(); ++i)
+      same = v[i] == Dac::convert(
+        sample_t::fromInternal(pcmFused[i] >> (15 - sample_t::FractionSize)),
+        clipped);
+    printf("  %.1fs played %s, %s the fused render\n",
+      double(out.played()) / DAC_RATE,
+      realTime ? "in real time" : "as fast as it would go",
+      same ? "bit-exact with" : "DIFFERENT from");
+
+    if (path) {
+      if (!out.writeWav(path)) {
+        printf("  couldn't write %s\n", path);
+        return false;
+      }
+      printf("  wrote %s\n", path);
+    }
+    DmaDac::clearSource();
+    return same;
+  }
+
+  template<template<int> class Tank>
+  void compareTank(const char* name,
+    std::vector<file_sample_t>& left, std::vector<file_sample_t>& right,
+    long totalSamples, const std::vector<int16_t>& full)
+  {
+    // the whole fused chain, with this tank, against the full tank
+    Rig<Tank> rig(left, right);
+    std::vector<int16_t> pcm;
+    uint64_t ns = render(rig, rig.fusedChain, totalSamples, pcm);
+
+    double err = 0, sig = 0;
+    for (size_t i = 0; i < pcm.size() && i < full.size(); ++i) {
+      double e = double(pcm[i]) - double(full[i]);
+      err += e * e;
+      sig += double(full[i]) * double(full[i]);
+    }
+    printf("  %-9s %6d bytes %6.2f ns/sample, %6.1f dB from the full tank\n",
+      name, int(sizeof(Tank<int(DelaySourceBase::maxDelay * SAMPLE_RATE)>)),
+      double(ns) / double(pcm.size()), 10 * log10(err / sig));
+  }
+
+
+  void reportBlockSizes(
+    std::vector<file_sample_t>& left, std::vector<file_sample_t>& right,
+    long totalSamples)
+  {
+    // What DmaDac's auto-tuning trades: smaller blocks are less latency,
+    // but the per block costs are spread over fewer samples.
+    for (int block = block_step; block <= buffer_count; block *= 2) {
+      Rig<> rig(left, right);
+      std::vector<int16_t> pcm;
+      uint64_t ns = render(rig, rig.fusedChain, totalSamples, pcm, block);
+      printf("  %2d samples, %5.2fms: %6.2f ns/sample\n",
+        block, 1000.0 * block / SAMPLE_RATE, double(ns) / double(pcm.size()));
+    }
+  }
+
+
+  std::vector<double> highPass(const std::vector<double>& x, double cutoff) {
+    // a windowed sinc, cutoff a fraction of the sample rate
+    const int half = 64;
+    std::vector<double> h(2 * half + 1);
+    for (int k = -half; k <= half; ++k) {
+      const double lp = k == 0 ? 2 * cutoff
+        : sin(2 * M_PI * cutoff * k) / (M_PI * k);
+      const double w = 0.42 + 0.5 * cos(M_PI * k / half)
+        + 0.08 * cos(2 * M_PI * k / half);
+      h[k + half] = (k == 0 ? 1.0 : 0.0) - lp * w;
+    }
+    std::vector<double> y(x.size(), 0.0);
+    for (size_t n = half; n + half < x.size(); ++n) {
+      double acc = 0;
+      for (int k = -half; k <= half; ++k) acc += h[k + half] * x[n - k];
+      y[n] = acc;
+    }
+    return y;
+  }
+
+  void compareWith(const char* refPath, const std::vector<int16_t>& pcm) {
+    // How far this render is from another, such as one with the engine at
+    // the full rate: overall, and in what's above 12kHz, which a half rate
+    // engine can only have as images of what's below.
+    int rate;
+    std::vector<float> refIn;
+    if (!readWav(refPath, rate, refIn) || rate != int(DAC_RATE)) {
+      printf("  couldn't read %s at %dHz\n", refPath, int(DAC_RATE));
+      return;
+    }
+    std::vector<double> ref(refIn.begin(), refIn.end());
+    std::vector<double> out;
+    for (auto v : pcm) out.push_back(v / 32768.0);
+    const size_t n = std::min(ref.size(), out.size());
+
+    // the upsampler delays the output a few samples: line them up
+    auto energyOf = [](const std::vector<double>& x, size_t from, size_t to) {
+      double e = 0;
+      for (size_t i = from; i < to; ++i) e += x[i] * x[i];
+      return e;
+    };
+    const int most = 4 * ENGINE_DIVISOR;
+    int lag = 0;
+    double best = HUGE_VAL;
+    for (int l = 0; l <= most; ++l) {
+      double e = 0;
+      for (size_t i = most; i < n; ++i) {
+        const double d = out[i] - ref[i - l];
+        e += d * d;
+      }
+      if (e < best) { best = e; lag = l; }
+    }
+
+    const double refE = energyOf(ref, 0, n - lag);
+    const auto refHi = highPass(ref, 0.25);
+    const auto outHi = highPass(out, 0.25);
+    printf("  %s: %.1f dB from it, %d samples later\n",
+      refPath, 10 * log10(best / refE), lag);
+    printf("  above %dHz: %.1f dB here, %.1f dB there\n", int(DAC_RATE) / 4,
+      10 * log10(energyOf(outHi, lag, n) / refE),
+      10 * log10(energyOf(refHi, 0, n - lag) / refE));
+  }
+
+
+  void usage() {
+    fprintf(stderr,
+      "usage: pbox-bench [-o out.wav] [-t seconds] [-c ref.wav]"
+      " [-d dmadac.wav] [-p] [left.raw [right.raw]]\n");
+    exit(2);
+  }
+}
+
+
+int main(int argc, char* argv[]) {
+  const char* outPath = "pbox-bench.wav";
+  const char* refPath = nullptr;
+  const char* dmaPath = nullptr;
+  bool realTime = false;
+  float seconds = 20.0f;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:t:c:d:p")) != -1) {
+    switch (opt) {
+      case 'o':   outPath = optarg;           break;
+      case 'c':   refPath = optarg;           break;
+      case 'd':   dmaPath = optarg;           break;
+      case 'p':   realTime = true;            break;
+      case 't':   seconds = atof(optarg);     break;
+      default:    usage();
+    }
+  }
+
+  std::vector<file_sample_t> left, right;
+  if (optind < argc)  left = readRaw(argv[optind++]);
+  else                left = synthKick();
+  if (optind < argc)  right = readRaw(argv[optind++]);
+  else                right = synthPad();
+  if (optind < argc)  usage();
+
+  Rig<> node(left, right);
+  Rig<> fused(left, right);
+
+  const long totalSamples = long(seconds * SAMPLE_RATE);
+  std::vector<int16_t> pcm, pcmFused;
+  uint64_t chainNs = render(node, node.delayPedalP, totalSamples, pcm);
+  uint64_t fusedNs = render(fused, fused.fusedChain, totalSamples, pcmFused);
+
+  const double renderedSeconds = double(pcm.size()) / DAC_RATE;
+  const double deadlineNs = 1e9 / DAC_RATE;
+  auto reportChain = [&](const char* name, uint64_t ns) {
+    const double nsPerSample = double(ns) / double(pcm.size());
+    printf("%s: %.2f ns/sample, %.0f samples/s, %.1fx real time\n",
+      name, nsPerSample, 1e9 / nsPerSample, deadlineNs / nsPerSample);
+  };
+
+  printf("rendered %.1fs of audio at %dHz, in blocks of %d samples\n",
+    renderedSeconds, int(SAMPLE_RATE), buffer_count);
+  if (ENGINE_DIVISOR > 1)
+    printf("upsampled to %dHz: the whole chain times are per %dHz sample,"
+      " the nodes' per %dHz sample\n",
+      int(DAC_RATE), int(DAC_RATE), int(SAMPLE_RATE));
+  printf("per node (excluding the nodes it pulls from):\n");
+  node.gate1P.report();
+  node.gate2P.report();
+  node.mixP.report();
+  node.filtP.report();
+  node.delayPedalP.report();
+  reportChain("whole chain", chainNs);
+
+  const double voiceSamples =
+    double(node.gate1.voicesRendered() + node.gate2.voicesRendered())
+    * buffer_count;
+  if (voiceSamples > 0) {
+    printf("gate voices: %.2f active per pad on average, %.2f ns and"
+      " %.1f cycles per active voice per sample\n",
+      voiceSamples / double(node.gate1P.samples + node.gate2P.samples),
+      double(node.gate1P.ns + node.gate2P.ns) / voiceSamples,
+      double(node.gate1P.cycles + node.gate2P.cycles) / voiceSamples);
+
+    // NB: As sound.h budgets them, but from this run's cycles.
+    auto m0 = [](const Probe& p) {
+      return double(p.cycles) / double(p.samples) * m0_cycles_per_host_cycle;
+    };
+    const double voice = double(node.gate1P.cycles + node.gate2P.cycles)
+      / voiceSamples * m0_cycles_per_host_cycle;
+    const double rest = 2 * m0(node.mixP) + m0(node.filtP)
+      + m0(node.delayPedalP) + stream_cycles_per_sample;
+    printf("gate voice budget, at %d SAMD21 cycles a host cycle: %.0f cycles"
+      " a voice, %.0f the rest of the chain, so %d voices fit;"
+      " sound.h allows %d\n",
+      m0_cycles_per_host_cycle, voice, rest,
+      int((render_cycles_per_sample - rest) / voice), max_gate_voices);
+  }
+
+  printf("fused chain, filt and delayPedal in one loop:\n");
+  fused.gate1P.report();
+  fused.gate2P.report();
+  fused.mixP.report();
+  reportChain("whole fused chain", fusedNs);
+  printf("fused output %s the per node output\n",
+    pcm == pcmFused ? "matches" : "DIFFERS from");
+
+  reportAllKernels(right);
+  reportVarRates();
+  reportGranular(right);
+  printf("sample formats, the pad at %dHz, against 16 bits:\n",
+    file_sample_rate);
+  reportFormats(0);
+  reportFormats(-24);
+  printf("streaming:\n");
+  bool streamOk = checkStreaming(right) && checkHeads(right);
+  printf("sample headers:\n");
+  bool headerOk = checkHeaders(right);
+  printf("clicks:\n");
+  bool clickOk = checkClicks() && checkSettle();
+  printf("DAC conversion, the whole fused chain:\n");
+  bool dacOk = checkDacChain(left, right, totalSamples);
+  printf("DmaDac, to a host output:\n");
+  bool outputOk = checkHostOutput(left, right, pcmFused, realTime, dmaPath);
+  printf("block sizes, the whole fused chain:\n");
+  reportBlockSizes(left, right, totalSamples);
+  reportDelayReads();
+  printf("delay tanks, in the whole fused chain:\n");
+  compareTank<MuLawTank>("mu-law", left, right, totalSamples, pcmFused);
+  compareTank<HalfRateTank>("half-rate", left, right, totalSamples, pcmFused);
+  printf("filter, %.0fHz to %.0fHz:\n", filterFreqLo, filterFreqHi);
+  bool filterOk = checkFilter();
+  printf("SWAR kernels, against the scalar reference:\n");
+  bool swarOk = checkSwar();
+  printf("scratch: %d of %d buffers used (%d needed), %d bytes\n",
+    scratch.highWater(), scratch.size(), node.delayPedalP.scratchDepth(),
+    int(sizeof(scratch_buffers)));
+  {
+    // NB: As pbox.ino adds them up, but with the host's 8 byte pointers.
+    using R = Rig<HalfRateTank>;
+    const size_t graph = sizeof(R::gate1) + sizeof(R::gate2)
+      + sizeof(R::backingStream) + sizeof(R::backing) + sizeof(R::padMix)
+      + sizeof(R::mix) + sizeof(R::filt) + sizeof(R::delayPedal)
+      + sizeof(R::fusedChain);
+    printf("static RAM: %d bytes, DmaDac %d and the graph %d: the pads %d"
+      " each, the stream %d, the delay %d\n",
+      int(DmaDac::ram_bytes + graph), int(DmaDac::ram_bytes), int(graph),
+      int(sizeof(R::gate1)),
+      int(sizeof(R::backingStream)), int(sizeof(R::delayPedal)));
+  }
+
+  if (!writeWav(outPath, int(DAC_RATE), pcm)) {
+    fprintf(stderr, "couldn't write %s\n", outPath);
+    return 1;
+  }
+  printf("wrote %s\n", outPath);
+  if (refPath) {
+    printf("against another render:\n");
+    compareWith(refPath, pcm);
+  }
+  return pcm == pcmFused && filterOk && swarOk && streamOk && headerOk
+    && clickOk && dacOk && outputOk ? 0 : 1;
+}
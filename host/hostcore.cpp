@@ -0,0 +1,18 @@
+#include <Arduino.h>
+
+#include <chrono>
+
+// Host versions of the Arduino core timing calls.
+
+namespace {
+  const auto start = std::chrono::steady_clock::now();
+
+  template<typename D>
+  unsigned long since_start() {
+    auto d = std::chrono::steady_clock::now() - start;
+    return (unsigned long)std::chrono::duration_cast<D>(d).count();
+  }
+}
+
+unsigned long micros() { return since_start<std::chrono::microseconds>(); }
+unsigned long millis() { return since_start<std::chrono::milliseconds>(); }
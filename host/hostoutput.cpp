@@ -0,0 +1,47 @@
+#include "hostoutput.h"
+
+#include <chrono>
+#include <thread>
+
+#include "wavfile.h"
+
+void HostOutput::start() {
+  for (int d = 0; d < 2; ++d)
+    buffers[d] = DmaDac::next(counts[d]);
+  finishing = 0;
+}
+
+void HostOutput::run(long samples, bool realTime) {
+  using clock = std::chrono::steady_clock;
+  const auto begun = clock::now();
+  const long first = playedCount;
+
+  while (playedCount - first < samples) {
+    const int d = finishing;
+    if (keeping)
+      kept.insert(kept.end(), buffers[d], buffers[d] + counts[d]);
+    playedCount += counts[d];
+
+    if (realTime) {
+      // NB: This buffer is done once it has played, so the next is only
+      //     taken then, and the render gets as long as it would on the box.
+      const double s = double(playedCount - first) / DAC_RATE;
+      std::this_thread::sleep_until(begun +
+        std::chrono::duration_cast<clock::duration>(
+          std::chrono::duration<double>(s)));
+    }
+
+    buffers[d] = DmaDac::next(counts[d]);
+    finishing = 1 - d;
+    DmaDac::render();
+  }
+}
+
+bool HostOutput::writeWav(const char* path) const {
+  const int zero = 1 << (bits() - 1);
+  std::vector<int16_t> pcm;
+  pcm.reserve(kept.size());
+  for (auto v : kept)
+    pcm.push_back(int16_t((int(v) - zero) << (16 - bits())));
+  return ::writeWav(path, int(DAC_RATE), pcm);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "dmadac.h"
+
+// A host output for DmaDac: the same ring, render and conversion as on the
+// box, with the buffers kept in memory, for writing to a WAV file, or
+// dropped. Nothing interrupts on the host, so run() plays the part of the
+// DMAC and PendSV in turn: each buffer it finishes, it takes the next, and
+// then renders, either as fast as it can, or paced to DAC_RATE.
+
+class HostOutput : public DmaDac::Output {
+public:
+  explicit HostOutput(bool keep) : keeping(keep) { }
+    // keep the output values, or just drop them
+
+  virtual int bits() const { return DAC_BITS; }
+  virtual const char* name() const { return "host output"; }
+  virtual void start();
+
+  void run(long samples, bool realTime);
+    // plays at least this many samples, at DAC_RATE
+
+  const std::vector<DmaDac::dac_t>& values() const { return kept; }
+  long played() const { return playedCount; }
+  bool writeWav(const char* path) const;
+
+private:
+  bool keeping;
+  std::vector<DmaDac::dac_t> kept;
+  long playedCount = 0;
+
+  const DmaDac::dac_t* buffers[2];    // as the DMAC's two descriptors
+  int counts[2];
+  int finishing = 0;
+};
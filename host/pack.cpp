@@ -0,0 +1,356 @@
+// pbox-pack: packs a pair of samples, from WAV files, into a bank image
+// ready to flash (see bankimage.h), so the box does no work on them at all.
+//
+//    pbox-pack [-f format] [-r rate] [-k] [-L] -o 1.pbi left.wav [right.wav]
+//
+// Each sample is resampled to the rate (24000 unless given), normalized,
+// given loop points if it's long enough to loop, encoded, and given a
+// SampleHeader. The format is one of linear8 (the default), linear16, ima,
+// mulaw or bfp. -k keeps each sample's level, in the header's gain, rather
+// than bringing them all up to full scale; -L doesn't loop either sample.
+//
+// The pads play at one fixed rate, pad_rate, and the box refuses a sample
+// at any other, so -r only takes that; it's there for when they don't.
+//
+// Name the image for the pad digit, 1.pbi to 5.pbi, and copy it to the
+// box's file system; the sample finder flashes it as it would a pair.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "adpcm.h"
+#include "bankimage.h"
+#include "blockfloat.h"
+#include "mulaw.h"
+#include "nvmmanager.h"
+#include "sound.h"
+#include "wavfile.h"
+
+namespace {
+
+  struct FormatName {
+    const char* name;
+    Samples::Format format;
+  };
+
+  const FormatName formats[] = {
+    { "linear8", Samples::linear8 },
+    { "linear16", Samples::linear16 },
+    { "ima", Samples::imaAdpcm },
+    { "mulaw", Samples::muLaw8 },
+    { "bfp", Samples::blockFloat8 },
+  };
+
+  const int pad_rate = 24000;           // file_sample_rate in pbox.ino
+
+  struct Options {
+    Samples::Format format = Samples::linear8;
+    int rate = pad_rate;
+    bool keepLevel = false;
+    bool loop = true;
+  };
+
+  const float normal_peak = 0.944f;     // -0.5dB: room for the encoders
+
+
+  /***
+   *** Resampling: windowed sinc
+   ***/
+
+  std::vector<float> resample(const std::vector<float>& in, int from, int to) {
+    if (from == to) return in;
+
+    // NB: The cutoff is just under the lower of the two Nyquist rates, so
+    //     that going down, nothing folds back.
+    const int zeros = 16;                   // zero crossings either side
+    const double ratio = double(from) / to;
+    const double cutoff = 0.95 * std::min(1.0, 1.0 / ratio);
+    const double reach = zeros / cutoff;    // in input samples
+
+    std::vector<float> out(size_t(in.size() / ratio));
+    for (size_t n = 0; n < out.size(); ++n) {
+      const double at = n * ratio;
+      const long first = long(ceil(at - reach));
+      const long last = long(floor(at + reach));
+      double sum = 0;
+      for (long k = std::max(first, 0L);
+          k <= last && k < long(in.size()); ++k) {
+        const double x = (k - at) * cutoff;
+        const double sinc = x == 0 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+        const double w = (k - at) / reach;      // -1 to 1
+        const double blackman =
+          0.42 + 0.5 * cos(M_PI * w) + 0.08 * cos(2 * M_PI * w);
+        sum += in[k] * cutoff * sinc * blackman;
+      }
+      out[n] = float(sum);
+    }
+    return out;
+  }
+
+
+  /***
+   *** Loop points
+   ***/
+
+  // Playing jumps from just before loopEnd to loopStart, so a good pair is
+  // one where what comes before each is nearly the same: the waveform then
+  // carries on across the jump. Candidates are rising zero crossings, with
+  // the start in the first half, and the end in the last quarter. For
+  // ADPCM, the start must also start a block, as the box can only seek to
+  // one.
+
+  struct Loop {
+    int start;
+    int end;
+    double match;     // difference over the windows, against their energy
+  };
+
+  std::vector<int> risingZeros(const std::vector<int16_t>& x,
+    int from, int to, int most)
+  {
+    std::vector<int> found;
+    for (int n = std::max(from, 1); n < to; ++n)
+      if (x[n - 1] < 0 && x[n] >= 0) found.push_back(n);
+    if (int(found.size()) <= most) return found;
+
+    std::vector<int> some;
+    for (int i = 0; i < most; ++i) some.push_back(found[found.size() * i / most]);
+    return some;
+  }
+
+  Loop findLoop(const std::vector<int16_t>& x, int rate, Samples::Format f) {
+    const int length = int(x.size());
+    const int window = rate / 100;
+    const int shortest = rate / 4;
+    const Samples blocks(nullptr, 0, f);
+    Loop best = { 0, length, 1.0 };
+
+    std::vector<int> starts;
+    if (f == Samples::imaAdpcm) {
+      for (int n = blocks.blockStart(window + ImaAdpcm::block_samples - 1);
+          n < length / 2; n += ImaAdpcm::block_samples)
+        starts.push_back(n);
+    }
+    else
+      starts = risingZeros(x, window, length / 2, 256);
+    const std::vector<int> ends = risingZeros(x, length - length / 4, length, 256);
+
+    for (int e : ends)
+      for (int s : starts) {
+        if (e - s < shortest) continue;
+        double diff = 0, energy = 0;
+        for (int k = -window; k < 0; ++k) {
+          const double a = x[s + k], b = x[e + k];
+          diff += (a - b) * (a - b);
+          energy += a * a + b * b;
+        }
+        const double match = energy > 0 ? diff / energy : 1.0;
+        if (match < best.match) best = { s, e, match };
+      }
+    return best;
+  }
+
+
+  /***
+   *** Encoding
+   ***/
+
+  std::vector<uint8_t> encode(const std::vector<int16_t>& x, Samples::Format f) {
+    std::vector<uint8_t> out;
+    switch (f) {
+      case Samples::linear8:
+        for (auto v : x)
+          out.push_back(uint8_t(int8_t(std::min((v + 128) >> 8, 127))));
+        break;
+
+      case Samples::linear16:
+        for (auto v : x) {
+          out.push_back(uint8_t(v));
+          out.push_back(uint8_t(v >> 8));
+        }
+        break;
+
+      case Samples::muLaw8:
+        for (auto v : x) out.push_back(MuLaw::encode(v));
+        break;
+
+      case Samples::imaAdpcm: {
+        const size_t blocks = ImaAdpcm::blockCount(x.size());
+        out.resize(blocks * ImaAdpcm::block_bytes);
+        ImaAdpcm::State s = { 0, 0 };
+        for (size_t b = 0; b < blocks; ++b) {
+          const size_t first = b * ImaAdpcm::block_samples;
+          ImaAdpcm::encodeBlock(x.data() + first,
+            int(std::min(x.size() - first, size_t(ImaAdpcm::block_samples))),
+            s, out.data() + b * ImaAdpcm::block_bytes);
+        }
+        break;
+      }
+
+      case Samples::blockFloat8: {
+        const size_t blocks = BlockFloat::blockCount(x.size());
+        out.resize(blocks * BlockFloat::block_bytes);
+        for (size_t b = 0; b < blocks; ++b) {
+          const size_t first = b * BlockFloat::block_samples;
+          BlockFloat::encodeBlock(x.data() + first,
+            int(std::min(x.size() - first, size_t(BlockFloat::block_samples))),
+            out.data() + b * BlockFloat::block_bytes);
+        }
+        break;
+      }
+    }
+    return out;
+  }
+
+
+  /***
+   *** One side of the pair
+   ***/
+
+  struct Packed {
+    std::vector<uint8_t> bytes;
+    SampleHeader header;
+  };
+
+  bool pack(const char* path, const Options& opt, Packed& p) {
+    int fileRate;
+    std::vector<float> in;
+    if (!readWav(path, fileRate, in) || in.empty()) {
+      fprintf(stderr, "couldn't read %s as a WAV file\n", path);
+      return false;
+    }
+    const std::vector<float> x = resample(in, fileRate, opt.rate);
+
+    float peak = 0;
+    for (auto v : x) peak = std::max(peak, fabsf(v));
+    const float scale = peak > 0 ? normal_peak / peak : 1.0f;
+
+    std::vector<int16_t> pcm(x.size());
+    for (size_t i = 0; i < x.size(); ++i)
+      pcm[i] = int16_t(lrintf(std::max(-1.0f, std::min(x[i] * scale, 1.0f))
+        * 32767.0f));
+
+    p.bytes = encode(pcm, opt.format);
+    const int length = Samples(p.bytes.data(), p.bytes.size(), opt.format)
+      .length();
+    p.header = SampleHeader::defaults(opt.format, opt.rate, length);
+    if (opt.keepLevel)
+      p.header.gain = uint16_t(std::min(65535L,
+        lrintf((1 << SampleHeader::gain_bits) / scale)));
+
+    printf("%s: %dHz, %.2fs, peak %.1fdB -> %dHz, %d bytes",
+      path, fileRate, double(in.size()) / fileRate, 20 * log10(peak + 1e-9),
+      opt.rate, int(p.bytes.size()));
+    if (opt.loop && p.header.looped()) {
+      const Loop l = findLoop(pcm, opt.rate, opt.format);
+      p.header.loopStart = l.start;
+      p.header.loopEnd = l.end;
+      printf(", loops %.3fs to %.3fs (%.0fdB off)",
+        double(l.start) / opt.rate, double(l.end) / opt.rate,
+        10 * log10(l.match + 1e-9));
+    }
+    else {
+      p.header.loopStart = p.header.loopEnd = 0;
+      printf(", one shot");
+    }
+    printf("\n");
+    return true;
+  }
+
+
+  /***
+   *** The image
+   ***/
+
+  bool writeImage(const char* path, const Packed& left, const Packed& right) {
+    // NB: As SampleFinder's loadPairToFlash() lays out the flash: the
+    //     directory in the first block, then each side blockAfter() the last.
+    static_assert(sizeof(BankImage) <= NvmManager::block_size,
+      "BankImage must fit where the FlashedDir goes");
+
+    BankImage image;
+    memset(&image, 0, sizeof(image));
+    image.magic = BankImage::magic_marker;
+    image.version = BankImage::current_version;
+    image.blockSize = NvmManager::block_size;
+    image.left.offset = NvmManager::blockRound(sizeof(BankImage));
+    image.left.size = left.bytes.size();
+    image.left.header = left.header;
+    image.right.offset =
+      image.left.offset + NvmManager::blockRound(left.bytes.size());
+    image.right.size = right.bytes.size();
+    image.right.header = right.header;
+
+    std::vector<uint8_t> out(image.right.offset + right.bytes.size());
+    memcpy(out.data(), &image, sizeof(image));
+    std::copy(left.bytes.begin(), left.bytes.end(),
+      out.begin() + image.left.offset);
+    std::copy(right.bytes.begin(), right.bytes.end(),
+      out.begin() + image.right.offset);
+
+    FILE* f = fopen(path, "wb");
+    if (!f) return false;
+    const bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+    if (fclose(f) != 0 || !ok) return false;
+
+    printf("wrote %s: %d bytes, %d blocks of flash\n", path, int(out.size()),
+      int(NvmManager::blockRound(out.size()) / NvmManager::block_size));
+    return true;
+  }
+
+
+  void usage() {
+    fprintf(stderr,
+      "usage: pbox-pack [-f format] [-r rate] [-k] [-L] -o out.pbi"
+      " left.wav [right.wav]\n"
+      "  formats:");
+    for (auto& f : formats) fprintf(stderr, " %s", f.name);
+    fprintf(stderr, "\n");
+    exit(2);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  Options opt;
+  const char* outPath = nullptr;
+
+  int c;
+  while ((c = getopt(argc, argv, "f:r:kLo:")) != -1) {
+    switch (c) {
+      case 'f': {
+        const FormatName* f = nullptr;
+        for (auto& g : formats) if (strcmp(optarg, g.name) == 0) f = &g;
+        if (!f) usage();
+        opt.format = f->format;
+        break;
+      }
+      case 'r':   opt.rate = atoi(optarg);    break;
+      case 'k':   opt.keepLevel = true;       break;
+      case 'L':   opt.loop = false;           break;
+      case 'o':   outPath = optarg;           break;
+      default:    usage();
+    }
+  }
+  if (!outPath || opt.rate <= 0 || optind >= argc || argc - optind > 2)
+    usage();
+  if (opt.rate != pad_rate) {
+    fprintf(stderr, "the box's pads only play %dHz samples\n", pad_rate);
+    return 2;
+  }
+
+  Packed left{}, right{};     // NB: a side not given has a zero header
+  if (!pack(argv[optind], opt, left)) return 1;
+  if (optind + 1 < argc && !pack(argv[optind + 1], opt, right)) return 1;
+
+  if (!writeImage(outPath, left, right)) {
+    fprintf(stderr, "couldn't write %s\n", outPath);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,111 @@
+#include "wavfile.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace {
+  void put16(FILE* f, uint16_t v) {
+    fputc(v & 0xff, f);
+    fputc(v >> 8, f);
+  }
+
+  void put32(FILE* f, uint32_t v) {
+    put16(f, v & 0xffff);
+    put16(f, v >> 16);
+  }
+
+  uint32_t get(const uint8_t* p, int bytes) {
+    uint32_t v = 0;
+    for (int i = bytes - 1; i >= 0; --i) v = (v << 8) | p[i];
+    return v;
+  }
+}
+
+bool writeWav(const char* path, int sampleRate, const std::vector<int16_t>& pcm) {
+  FILE* f = fopen(path, "wb");
+  if (!f) return false;
+
+  const uint32_t dataBytes = pcm.size() * sizeof(int16_t);
+
+  fputs("RIFF", f);   put32(f, 36 + dataBytes);
+  fputs("WAVE", f);
+
+  fputs("fmt ", f);   put32(f, 16);
+  put16(f, 1);                    // PCM
+  put16(f, 1);                    // mono
+  put32(f, sampleRate);
+  put32(f, sampleRate * sizeof(int16_t));
+  put16(f, sizeof(int16_t));      // block align
+  put16(f, 16);                   // bits per sample
+
+  fputs("data", f);   put32(f, dataBytes);
+  for (auto s : pcm) put16(f, uint16_t(s));
+
+  bool ok = !ferror(f);
+  return fclose(f) == 0 && ok;
+}
+
+bool readWav(const char* path, int& sampleRate, std::vector<float>& mono) {
+  FILE* f = fopen(path, "rb");
+  if (!f) return false;
+  std::vector<uint8_t> file;
+  int c;
+  while ((c = fgetc(f)) != EOF) file.push_back(uint8_t(c));
+  fclose(f);
+
+  if (file.size() < 12 || memcmp(&file[0], "RIFF", 4) != 0
+      || memcmp(&file[8], "WAVE", 4) != 0)
+    return false;
+
+  int format = 0, channels = 0, bits = 0;
+  const uint8_t* data = nullptr;
+  size_t dataBytes = 0;
+
+  for (size_t at = 12; at + 8 <= file.size(); ) {
+    const uint8_t* chunk = &file[at];
+    const size_t size = get(chunk + 4, 4);
+    const size_t body = std::min(size, file.size() - at - 8);
+
+    if (memcmp(chunk, "fmt ", 4) == 0 && body >= 16) {
+      format = int(get(chunk + 8, 2));
+      channels = int(get(chunk + 10, 2));
+      sampleRate = int(get(chunk + 12, 4));
+      bits = int(get(chunk + 22, 2));
+      if (format == 0xfffe && body >= 26)
+        format = int(get(chunk + 32, 2));     // WAVE_FORMAT_EXTENSIBLE
+    }
+    else if (memcmp(chunk, "data", 4) == 0) {
+      data = chunk + 8;
+      dataBytes = body;
+    }
+    at += 8 + size + (size & 1);
+  }
+
+  const bool pcm = format == 1 && bits >= 8 && bits <= 32 && bits % 8 == 0;
+  const bool ieee = format == 3 && bits == 32;
+  if (!data || channels < 1 || sampleRate <= 0 || !(pcm || ieee))
+    return false;
+
+  const int bytes = bits / 8;
+  const size_t frames = dataBytes / (bytes * channels);
+  mono.assign(frames, 0.0f);
+  for (size_t i = 0; i < frames; ++i) {
+    float sum = 0;
+    for (int ch = 0; ch < channels; ++ch) {
+      const uint32_t v = get(data + (i * channels + ch) * bytes, bytes);
+      if (ieee) {
+        float x;
+        memcpy(&x, &v, sizeof(x));
+        sum += x;
+      }
+      else if (bits == 8)
+        sum += (int(v) - 128) / 128.0f;       // 8 bit WAV is unsigned
+      else
+        sum += float(int32_t(v << (32 - bits))) / 2147483648.0f;
+    }
+    mono[i] = sum / channels;
+  }
+  return true;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+// Minimal WAV file support, for the host tools.
+
+bool writeWav(const char* path, int sampleRate, const std::vector<int16_t>& pcm);
+  // mono, 16 bit PCM
+
+bool readWav(const char* path, int& sampleRate, std::vector<float>& mono);
+  // 8, 16, 24 or 32 bit PCM, or 32 bit float, any number of channels,
+  // mixed down to mono, as -1.0 to 1.0
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Interpolation kernels for upsampling sample data by an integer factor,
+ * and (at the end) interpolators for reading between samples at any
+ * fractional position.
+ *
+ * Each kernel is a polyphase FIR: for output phase p (0 <= p < factor), the
+ * output is the sum over k of weight(p, k) * sample[n - before + k], divided
+ * by scale. The weights are integers, so the sum can be done with integer
+ * multiplies, and the one division folded into the amplitude.
+ */
+
+template<int factor>
+struct ZeroOrderKernel {
+  static constexpr int taps = 1;
+  static constexpr int before = 0;
+  static constexpr int scale = 1;
+
+  static constexpr int weight(int p, int k) { return 1; }
+};
+
+template<int factor>
+struct LinearKernel {
+  static constexpr int taps = 2;
+  static constexpr int before = 0;
+  static constexpr int scale = factor;
+
+  static constexpr int weight(int p, int k) { return k == 0 ? factor - p : p; }
+};
+
+template<int factor>
+struct CubicKernel {
+  // Catmull-Rom, at t = p / factor, with every weight scaled by 2 * factor^3
+  static constexpr int taps = 4;
+  static constexpr int before = 1;
+  static constexpr int scale = 2 * factor * factor * factor;
+
+  static constexpr int weight(int p, int k) {
+    return
+        k == 0 ? -p*p*p + 2*p*p*factor - p*factor*factor
+      : k == 1 ? 3*p*p*p - 5*p*p*factor + 2*factor*factor*factor
+      : k == 2 ? -3*p*p*p + 4*p*p*factor + p*factor*factor
+      :          p*p*p - p*p*factor;
+  }
+};
+
+
+template<int factor, template<int> class Kernel>
+struct KernelTable {
+  using K = Kernel<factor>;
+  int16_t w[factor][K::taps];
+
+  constexpr KernelTable() : w() {
+    for (int p = 0; p < factor; ++p)
+      for (int k = 0; k < K::taps; ++k)
+        w[p][k] = K::weight(p, k);
+  }
+};
+
+
+template<int n>
+struct Unrolled {
+  // calls f(0) ... f(n-1), with no loop left after inlining
+  template<typename F>
+  static inline void run(F& f) { Unrolled<n - 1>::run(f); f(n - 1); }
+};
+
+template<>
+struct Unrolled<0> {
+  template<typename F>
+  static inline void run(F&) { }
+};
+
+
+template<int factor, template<int> class Kernel>
+struct Interpolator {
+  using K = Kernel<factor>;
+  static constexpr int taps = K::taps;
+  static constexpr int before = K::before;
+  static constexpr int scale = K::scale;
+
+  template<typename Out, typename Sample, typename Tap, typename Comp>
+  static inline void step(Sample*& buffer, const Tap* tap,
+      Comp a, int32_t tapToComp)
+  {
+    // Writes factor output samples from one set of taps, tap[0] to
+    // tap[taps - 1]. tapToComp is the multiplier that takes a tap value to
+    // the raw value of a Comp.
+
+    static constexpr KernelTable<factor, Kernel> table;
+
+    auto phase = [&](int p) {
+      int32_t acc = 0;
+      for (int k = 0; k < taps; ++k) acc += table.w[p][k] * int32_t(tap[k]);
+      Out::put(buffer, Sample(Comp::fromInternal(acc * tapToComp) * a));
+    };
+    Unrolled<factor>::run(phase);
+  }
+};
+
+
+/* Interpolators at any fractional position, for playing at any rate.
+ *
+ * at(tap, t) interpolates at t (with 16 fraction bits) past tap[before],
+ * from 16 bit taps, tap[0] to tap[taps - 1]. The result has 13 fraction
+ * bits, as sample_t does: the two bits dropped are ones sample_t can't hold
+ * anyway, and they leave room for the arithmetic to stay in 32 bits.
+ */
+
+struct FracLinear {
+  static constexpr int taps = 2;
+  static constexpr int before = 0;
+
+  static inline int32_t at(const int16_t* tap, uint32_t t) {
+    // NB: t is cut to 15 bits so the product fits in 32 bits
+    const int32_t a = tap[0];
+    const int32_t b = tap[1];
+    return (a + ((b - a) * int32_t(t >> 1) >> 15)) >> 2;
+  }
+};
+
+struct FracCubic {
+  // Catmull-Rom, as CubicKernel, evaluated by Horner's rule
+  static constexpr int taps = 4;
+  static constexpr int before = 1;
+
+  static inline int32_t at(const int16_t* tap, uint32_t t) {
+    // NB: Taps have 13 fraction bits, and t is cut to 12, so that no
+    //     partial result exceeds 31 bits, however wild the taps.
+    const int32_t p0 = tap[0] >> 2;
+    const int32_t p1 = tap[1] >> 2;
+    const int32_t p2 = tap[2] >> 2;
+    const int32_t p3 = tap[3] >> 2;
+    const int32_t u = int32_t(t >> 4);
+
+    const int32_t c3 = 3 * (p1 - p2) + p3 - p0;
+    const int32_t c2 = 2 * p0 - 5 * p1 + 4 * p2 - p3;
+    const int32_t c1 = p2 - p0;
+
+    int32_t y = (c3 * u >> 12) + c2;
+    y = (y * u >> 12) + c1;
+    y = y * u >> 12;
+    return p1 + (y >> 1);
+  }
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+/* G.711 µ-law: 16 bit samples companded to 8 bits each.
+ *
+ * Small values keep more of their resolution than large ones, so quiet
+ * sounds fare far better than they do truncated to 8 bits. The encoder
+ * takes the top 14 bits of a sample, and clips at +/-32635. Decoding is a
+ * table lookup.
+ */
+
+namespace MuLaw {
+
+  constexpr int32_t bias = 0x84;
+  constexpr int32_t clip = 32635;
+
+  struct Tables {
+    uint8_t exponent[256];  // by the top byte of the biased magnitude
+    int16_t linear[256];    // by code
+
+    constexpr Tables() : exponent(), linear() {
+      for (int i = 0; i < 256; ++i) {
+        int e = 0;
+        while (e < 7 && (i >> (e + 1))) ++e;
+        exponent[i] = e;
+      }
+      for (int i = 0; i < 256; ++i) {
+        int c = ~i & 0xff;
+        int e = (c >> 4) & 7;
+        int m = c & 0x0f;
+        int32_t v = (((m << 3) + bias) << e) - bias;
+        linear[i] = int16_t(c & 0x80 ? -v : v);
+      }
+    }
+  };
+
+  inline const Tables& tables() {
+    static constexpr Tables t;
+    return t;
+  }
+
+  inline uint8_t encode(int32_t v) {
+    int sign = 0;
+    if (v < 0) { v = -v; sign = 0x80; }
+    if (v > clip) v = clip;
+    v += bias;
+    int e = tables().exponent[(v >> 7) & 0xff];
+    int m = (v >> (e + 3)) & 0x0f;
+    return uint8_t(~(sign | (e << 4) | m));
+  }
+
+  inline int16_t decode(uint8_t c) { return tables().linear[c]; }
+}
@@ -4,6 +4,7 @@
 #include <Adafruit_CircuitPlayground.h>
 
 #include "dmadac.h"
+#include "dmaoutput.h"
 #include "filesystem.h"
 #include "msg.h"
 #include "samplefinder.h"
@@ -11,19 +12,56 @@
 #include "touch.h"
 #include "types.h"
 
-const char* fileSuffix = "24k8.raw";
+DacOutput dacOutput;
+  // or PwmOutput, for 12 bits on A3, through an RC low-pass
+
 const int file_sample_rate = 24000;
+const SampleFinder::FileType fileTypes[] = {
+  { "24k8.raw", Samples::linear8, file_sample_rate },     // 8 bit signed
+  { "24k4.ima", Samples::imaAdpcm, file_sample_rate },    // IMA ADPCM blocks
+  { "24k16.raw", Samples::linear16, file_sample_rate },   // 16 bit signed
+  { "24k8.mu", Samples::muLaw8, file_sample_rate },       // µ-law
+  { "24k8.bfp", Samples::blockFloat8, file_sample_rate }, // block floating pt.
+};
+const int backing_head_ms = 50;
+  // of each backing track, cached in on-chip flash, to cover opening the
+  // file; pbox-bench shows how long is needed
+static_assert(SampleFinder::bankHeadBytes(
+    long(file_sample_rate) * backing_head_ms / 1000)
+  <= SampleFinder::max_bank_head_bytes,
+  "backing track heads too long to cache");
 
 TouchPad tp1 = TouchPad(A1);
 TouchPad tp2 = TouchPad(A2);
 int touchedOutPin = 0; // labeled "RX A6" on the board
 
-SampleGateSource<file_sample_rate> gate1;
-SampleGateSource<file_sample_rate> gate2;
-MixSource mix(gate1, gate2);
+const int voices_per_pad = 2;
+static_assert(2 * voices_per_pad <= max_gate_voices,
+  "pads have more voices than fit in a DMA buffer period");
+
+SamplePad<file_sample_rate, voices_per_pad> gate1;
+SamplePad<file_sample_rate, voices_per_pad> gate2;
+SampleStream backingStream;
+StreamSource<file_sample_rate> backing(backingStream);
+MixSource padMix(gate1, gate2);
+MixSource mix(padMix, backing);
 FilterSource filt(mix);
-DelaySource delayPedal(filt);
-SoundSource& chainOut = delayPedal;
+using DelayPedal = DelaySource<HalfRateTank>;
+  // NB: Half the RAM of FullTank, which is the largest thing in the sketch.
+  //     pbox-bench compares the tanks.
+DelayPedal delayPedal(filt);
+Chain<DmaDac::engine_count, MixSource, FilterSource, DelayPedal>
+  fusedChain(mix, filt, delayPedal);
+SoundSource& chainOut = fusedChain;
+
+constexpr size_t graph_ram_bytes = DmaDac::ram_bytes
+  + sizeof(gate1) + sizeof(gate2) + sizeof(backingStream) + sizeof(backing)
+  + sizeof(padMix) + sizeof(mix) + sizeof(filt) + sizeof(delayPedal)
+  + sizeof(fusedChain);
+static_assert(graph_ram_bytes <= 20 * 1024,
+  "the sound graph takes more than its share of the 32K of RAM");
+  // the rest is for SdFat, USB, Serial, the NeoPixels and the stack;
+  // pbox-bench prints the pieces
 
 
 auto c_off = CircuitPlayground.strip.Color(0, 0, 0);
@@ -137,6 +175,69 @@ bool sweepLoop(millis_t now) {
   return sweeping;
 }
 
+FatFile backingFile;
+Samples::Format backingFormat;
+bool backingFound = false;
+
+void startBacking() {
+  const int banked = SampleFinder::bankSize();
+  if (banked == 0) {
+    if (backingFound) backingStream.start(backingFile, backingFormat);
+    return;
+  }
+
+  // the head plays at once, while the file is opened
+  static int next = 0;
+  const int i = next++ % banked;
+  const bool tail = SampleFinder::bankHasTail(i);
+  backingStream.start(SampleFinder::bankHead(i), tail);
+
+  backingFile.close();
+  if (tail && !SampleFinder::openBankTail(i, backingFile))
+    backingStream.end();
+}
+
+void backingLoop(millis_t now) {
+  // the right button starts the next backing track, or stops this one
+  static bool rightPressed = false;
+  if (rightPressed != CircuitPlayground.rightButton()) {
+    rightPressed = CircuitPlayground.rightButton();
+    if (rightPressed) {
+      if (backingStream.playing())  backingStream.stop();
+      else                          startBacking();
+    }
+  }
+
+  if (backingFile.isOpen()) backingStream.fill(backingFile);
+}
+
+void padModeLoop(millis_t now) {
+  // a press of the left button recalibrates pad 1, once it's let go;
+  // holding it for a second switches the pads between gated and granular,
+  // and doesn't recalibrate
+  // NB: Calibrating while it's held would calibrate pad 1 for the whole
+  //     second, with a hand resting near it.
+  static millis_t pressedAt = 0;
+  static bool switched = false;
+
+  if (!CircuitPlayground.leftButton()) {
+    if (pressedAt != 0 && !switched) {
+      tp1.calibrate();
+      tp1.calibrate();
+    }
+    pressedAt = 0;
+    switched = false;
+    return;
+  }
+  if (pressedAt == 0) pressedAt = now;
+  if (!switched && now - pressedAt >= 1000) {
+    const bool g = !gate1.granular();
+    gate1.setGranular(g);
+    gate2.setGranular(g);
+    switched = true;
+  }
+}
+
 bool testToneLoop(millis_t now) {
   static bool playingTestTone = false;
   bool playTestTone = CircuitPlayground.rightButton();
@@ -183,16 +284,23 @@ void setup() {
     while (1) yield();
   }
 
-  SampleFinder::setup(fileSuffix);
+  SampleFinder::setup(fileTypes, sizeof(fileTypes)/sizeof(fileTypes[0]),
+    file_sample_rate, file_sample_rate * backing_head_ms / 1000);
 
   SampleFinder::FlashSamples fs = SampleFinder::flashSamples();
-  gate1.load(fs.left);
-  gate2.load(fs.right);
+  gate1.load(fs.left, fs.leftHeader);
+  gate2.load(fs.right, fs.rightHeader);
+
+  backingFound = SampleFinder::openStream(backingFile, backingFormat);
+  backing.setAmp(0.7f);
 
   auto now = millis();
 
-  DmaDac::begin();
-  DmaDac::setSource(chainOut);
+  if (!DmaDac::begin(dacOutput))
+    Serial.println("DmaDac can't convert to the output's width");
+  if (!DmaDac::setSource(chainOut))
+    Serial.println("Sound chain needs more scratch buffers than DmaDac has");
+  DmaDac::autoTune(true);
 
   pinMode(touchedOutPin, OUTPUT);
 
@@ -221,15 +329,16 @@ void loop() {
       finderMode = false;
     }
 
-    if (CircuitPlayground.leftButton()) {
-      tp1.calibrate();
-      tp1.calibrate();
-    }
+    padModeLoop(now);
+    backingLoop(now);
     // if (sweepLoop(now)) playable = false;
     // if (testToneLoop(now)) playable = false;
   } else {
     // Sample Finder Mode
     if (!finderMode) {
+      backingStream.stop();
+        // NB: Flashing samples keeps loop() away far longer than the
+        //     stream's ring lasts.
       SampleFinder::enter();
       finderMode = true;
     }
@@ -237,8 +346,8 @@ void loop() {
     SampleFinder::loop(now);
     if (SampleFinder::newFlashSamplesAvailable()) {
       SampleFinder::FlashSamples fs = SampleFinder::flashSamples();
-      gate1.load(fs.left);
-      gate2.load(fs.right);
+      gate1.load(fs.left, fs.leftHeader);
+      gate2.load(fs.right, fs.rightHeader);
     }
   }
 
@@ -269,9 +378,10 @@ void loop() {
     }
     digitalWrite(touchedOutPin, touched);
 
+    constexpr millis_t accel_period = 100;
     static millis_t accel_update = 0;
     if (now >= accel_update) {
-      accel_update = now + 100;
+      accel_update = now + accel_period;
 
       sensors_event_t event;
       CircuitPlayground.lis.getEvent(&event);
@@ -280,7 +390,8 @@ void loop() {
         // these are static because they are filtered versions of the event
         // since the accellerometer values can be jumpy with quick user motions
 
-      constexpr float accel_slew(0.63095734448);  // -20dB in 500ms
+      constexpr float accel_slew(
+        slewFactor(0.500, -20, 1000.0 / accel_period));
       x = event.acceleration.x - (event.acceleration.x - x) * accel_slew;
       y = event.acceleration.y - (event.acceleration.y - y) * accel_slew;
       z = event.acceleration.z - (event.acceleration.z - z) * accel_slew;
@@ -298,7 +409,7 @@ void loop() {
       gate2.setPosition(g);
 
       delayPedal.setDelayMod(map_range(x, 8.0f, -8.0f,
-          DelaySource::minMod, DelaySource::maxMod));
+          DelaySourceBase::minMod, DelaySourceBase::maxMod));
 
       float k = 9.0f - z;
       k = 324.0f - k * k;
@@ -328,6 +439,17 @@ void loop() {
       // Serial.print("tp2: "); tp2.printStats(Serial);
       // Serial.println("----");
       DmaDac::report(Serial);
+      Serial.printf("backing: %lu underruns, %lu samples missed, low water %d,"
+        " %lu of %lu tails late\n",
+        backingStream.underruns(), backingStream.samplesMissed(),
+        backingStream.lowWater(),
+        backingStream.tailsLate(), backingStream.tailsPlayed());
+      static unsigned long lastGrains = 0;
+      const unsigned long grains =
+        gate1.grainsStarted() + gate2.grainsStarted();
+      Serial.printf("grains: %lu/s, %lu dropped\n", grains - lastGrains,
+        gate1.grainsDropped() + gate2.grainsDropped());
+      lastGrains = grains;
   }
 #endif
 }
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <FixedPoints.h>
+
+using sample_t = SFixed<2, 13>;
+
+constexpr sample_t SAMPLE_ZERO = sample_t(0);
+constexpr sample_t SAMPLE_UNIT = sample_t(1);
+constexpr sample_t SAMPLE_POS_ONE = sample_t(1.0);
+constexpr sample_t SAMPLE_NEG_ONE = sample_t(-1.0);
+
+constexpr int DAC_BITS = 10;        // DAC on SAM D21 is only 10 bits
+  // other outputs may take more; see Swar::withDac()
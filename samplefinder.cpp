@@ -5,6 +5,7 @@
 #include <Adafruit_CircuitPlayground.h>
 #include <SdFat.h>
 
+#include "bankimage.h"
 #include "msg.h"
 #include "nvmmanager.h"
 
@@ -17,6 +18,7 @@ namespace {
   struct FlashedFile {
     void* data;
     size_t size;
+    SampleHeader header;
 
     uint16_t modTime;
     uint16_t modDate;
@@ -24,10 +26,12 @@ namespace {
 
   struct FlashedDir {
     uint32_t magic;
-    static const uint32_t magic_marker = 0x69A57FDA;
+    static const uint32_t magic_marker = 0x69A57FDD;
 
     FlashedFile left;
     FlashedFile right;
+
+    void* bank;   // the BankDir, after the pair, or nullptr
   };
 
   FlashedDir flashedDir;
@@ -41,8 +45,11 @@ namespace {
       flashedDir.magic = FlashedDir::magic_marker;
       flashedDir.left.data = nullptr;
       flashedDir.left.size = 0;
+      flashedDir.left.header = SampleHeader::defaults(Samples::linear8, 0, 0);
       flashedDir.right.data = nullptr;
       flashedDir.right.size = 0;
+      flashedDir.right.header = SampleHeader::defaults(Samples::linear8, 0, 0);
+      flashedDir.bank = nullptr;
     }
 
     flashDirChanged = true;
@@ -54,18 +61,58 @@ namespace {
 
   struct FileSamples {
     FatFile     file;
-    size_t      size() const { return file.isOpen() ? file.fileSize() : 0; }
+    size_t      size() const {
+      return !file.isOpen() ? 0 : packed ? packedSide.size : file.fileSize();
+    }
     uint16_t    modTime;
     uint16_t    modDate;
+    const SampleFinder::FileType* type;
+
+    SampleHeader sidecar;     // from the .hdr file, if found
+    const SampleFinder::FileType* sidecarType;
+
+    bool        packed;       // one side of a bank image
+    BankImage::Side packedSide;
 
     bool        found() const { return file.isOpen(); }
+    size_t      offset() const { return packed ? packedSide.offset : 0; }
+    SampleHeader header() const;
 
-    void setFile(FatFile& f);
-    void reset() { file.close(); }
+    void setFile(FatFile& f, const SampleFinder::FileType* t);
+    void setSidecar(FatFile& f, const SampleFinder::FileType* t);
+    void setPacked(FatFile& f, const BankImage::Side& s);
+    void reset() { file.close(); sidecarType = nullptr; packed = false; }
   };
 
-  void FileSamples::setFile(FatFile& f) {
+  SampleHeader FileSamples::header() const {
+    if (packed) return packedSide.header;
+
+    if (sidecarType == type && sidecar.valid() && sidecar.format == type->format)
+      return sidecar;
+
+    const Samples::Format f = type->format;
+    return SampleHeader::defaults(f, type->rate,
+      Samples(nullptr, size(), f).length());
+  }
+
+  void FileSamples::setSidecar(FatFile& f, const SampleFinder::FileType* t) {
+    if (f.read(&sidecar, sizeof(sidecar)) == sizeof(sidecar))
+      sidecarType = t;
+  }
+
+  void FileSamples::setPacked(FatFile& f, const BankImage::Side& s) {
+    packed = true;
+    packedSide = s;
+    setFile(f, nullptr);
+  }
+
+  void FileSamples::setFile(FatFile& f, const SampleFinder::FileType* t) {
+    // NB: A bank image takes the place of loose files, whichever is found
+    //     first.
+    if (packed && t) return;
+
     file = f;
+    type = t;
     if (!f.isOpen()) return;
 
     dir_t d;
@@ -86,7 +133,8 @@ namespace {
       fp_notFound,
       fp_found,
       fp_loaded,
-      fp_tooBig
+      fp_tooBig,
+      fp_wrongRate
     } status;
 
     void reset() { left.reset(); right.reset(); status = fp_notFound; }
@@ -98,8 +146,10 @@ namespace {
       return !s.found() || s.size() == 0;
     }
 
+    const SampleHeader h = s.header();
     return s.found()
       && f.size == s.size()
+      && memcmp(&f.header, &h, sizeof(h)) == 0
       && f.modTime == s.modTime
       && f.modDate == s.modDate;
   }
@@ -109,6 +159,19 @@ namespace {
       &&   flashMatchesFile(flashedDir.right, p.right);
   }
 
+  int playRate = 0;
+
+  bool rateMatches(const FileSamples& s, const char* side) {
+    // NB: The pads play at one fixed rate, so a sample at any other would
+    //     play out of tune.
+    if (!s.found() || s.size() == 0) return true;
+    const uint32_t rate = s.header().rate;
+    if (rate == uint32_t(playRate)) return true;
+    errorMsgf("%s sample is at %luHz, but the pads play %dHz",
+      side, (unsigned long)rate, playRate);
+    return false;
+  }
+
   bool flashCanHoldPair(const FilePair& p) {
     size_t size_left = p.left.found() ? p.left.size() : 0;
     size_t size_right = p.right.found() ? p.right.size() : 0;
@@ -121,20 +184,13 @@ namespace {
     return rightEnd <= dataEnd;
   }
 
-  void loadFileToFlash(void* data, FlashedFile& f, FileSamples& s) {
-    f.data = data;
-    f.size = s.size();
-    f.modTime = s.modTime;
-    f.modDate = s.modDate;
-
+  void copyFileToFlash(void* dst, FatFile& file, size_t count) {
     uint8_t buffer[NvmManager::block_size];
 
-    size_t count = f.size;
-    void* dst = f.data;
     statusMsgf("flashing file to %08x for %d bytes", dst, count);
 
     while (count > 0) {
-      auto r = s.file.read(buffer, min(count, NvmManager::block_size));
+      auto r = file.read(buffer, min(count, NvmManager::block_size));
       if (r <= 0) {
         errorMsg("error reading file");
       }
@@ -146,6 +202,17 @@ namespace {
     }
   }
 
+  void loadFileToFlash(void* data, FlashedFile& f, FileSamples& s) {
+    f.data = data;
+    f.size = s.size();
+    f.header = s.header();
+    f.modTime = s.modTime;
+    f.modDate = s.modDate;
+
+    s.file.seekSet(s.offset());
+    copyFileToFlash(f.data, s.file, f.size);
+  }
+
   void loadPairToFlash(FilePair& p) {
     void* dataBegin = NvmManager::dataBegin();
     void* dataEnd = NvmManager::dataEnd();
@@ -168,7 +235,32 @@ namespace {
 
   std::array<FilePair, 5> pairs;
 
-  void findFilePairs(const char* suffix) {
+  const SampleFinder::FileType* fileTypes = nullptr;
+  int fileTypeCount = 0;
+
+  const SampleFinder::FileType* typeOf(const String& name) {
+    for (int i = 0; i < fileTypeCount; ++i)
+      if (name.endsWith(fileTypes[i].suffix)) return &fileTypes[i];
+    return nullptr;
+  }
+
+  void findBankImage(FatFile& file, const String& nameStr) {
+    const int d = int(nameStr[0]) - int('1');
+    if (d < 0 || pairs.size() <= d || nameStr.length() != 5) return;
+
+    BankImage image;
+    if (file.read(&image, sizeof(image)) != sizeof(image)
+        || !image.valid(file.fileSize(), NvmManager::block_size)) {
+      statusMsgf("%s isn't a bank image for this box", nameStr.c_str());
+      return;
+    }
+
+    pairs[d].left.setPacked(file, image.left);
+    pairs[d].right.setPacked(file, image.right);
+    statusMsgf("found bank image %s", nameStr.c_str());
+  }
+
+  void findFilePairs() {
     for (auto& p : pairs) p.reset();
 
     FatFile root;
@@ -187,15 +279,32 @@ namespace {
       nameStr.toLowerCase();
 
       int d;
+      const SampleFinder::FileType* type;
+      bool sidecar;
+
+      if (nameStr.endsWith(".pbi")) {
+        findBankImage(file, nameStr);
+        goto nextFile;
+      }
+
+      sidecar = nameStr.endsWith(".hdr");
+      if (sidecar) nameStr.remove(nameStr.length() - 4);
 
-      if (!nameStr.endsWith(suffix)) goto nextFile;
+      type = typeOf(nameStr);
+      if (!type) goto nextFile;
 
       d = int(nameStr[0]) - int('1');
       if (d < 0 || pairs.size() <= d) goto nextFile;
 
       switch (nameStr[1]) {
-        case 'l':   pairs[d].left.setFile(file);    break;
-        case 'r':   pairs[d].right.setFile(file);   break;
+        case 'l':
+          if (sidecar)  pairs[d].left.setSidecar(file, type);
+          else          pairs[d].left.setFile(file, type);
+          break;
+        case 'r':
+          if (sidecar)  pairs[d].right.setSidecar(file, type);
+          else          pairs[d].right.setFile(file, type);
+          break;
         default:    goto nextFile;
       }
 
@@ -214,6 +323,9 @@ namespace {
       if (p.left.found() || p.right.found()) {
         // as long as we found one...
         if (!flashCanHoldPair(p))           p.status = FilePair::fp_tooBig;
+        else if (!rateMatches(p.left, "left")
+              || !rateMatches(p.right, "right"))
+                                            p.status = FilePair::fp_wrongRate;
         else if (flashMatchesPair(p))       p.status = FilePair::fp_loaded;
         else                                p.status = FilePair::fp_found;
       }
@@ -221,10 +333,210 @@ namespace {
   }
 
   /***
-   *** State of the Sample Finder
+   *** Heads of backing tracks, cached in on-chip Flash
    ***/
 
-  const char* sampleFileSuffix = "";
+  // Each backing track (a file named "bg" and a suffix) has its first few
+  // blocks copied to on-chip flash, after the pair of samples, so that it
+  // can start at once. The rest, the tail, is streamed from the file system.
+
+  struct BankEntry {
+    uint16_t dirIndex;        // of the file, in the root directory
+    Samples::Format format;
+    uint16_t headBytes;       // a whole number of SampleStream blocks
+    uint32_t fileSize;
+    uint16_t modTime;
+    uint16_t modDate;
+  };
+
+  struct BankDir {
+    uint32_t magic;
+    static const uint32_t magic_marker = 0x69A5BA4C;
+
+    static const int max_entries = 128;
+    int count;
+    BankEntry entries[max_entries];
+    // the heads follow, each starting on a block
+  };
+
+  int headSamples = 0;
+
+  const BankDir* bankDir() {
+    const BankDir* b = (const BankDir*)flashedDir.bank;
+    return b && b->magic == BankDir::magic_marker ? b : nullptr;
+  }
+
+  const BankEntry* bankEntry(int i) {
+    const BankDir* b = bankDir();
+    return b && 0 <= i && i < b->count ? &b->entries[i] : nullptr;
+  }
+
+  const void* bankHeadData(int i) {
+    const BankDir* b = bankDir();
+    void* p = NvmManager::blockAfter((void*)b, sizeof(BankDir));
+    for (int k = 0; k < i; ++k)
+      p = NvmManager::blockAfter(p, b->entries[k].headBytes);
+    return p;
+  }
+
+  void* pairEnd() {
+    void* end = NvmManager::blockAfter(NvmManager::dataBegin(), sizeof(FlashedDir));
+    for (const FlashedFile* f : { &flashedDir.left, &flashedDir.right })
+      if (f->data && f->size)
+        end = max(end, NvmManager::blockAfter(f->data, f->size));
+    return end;
+  }
+
+  static_assert(SampleFinder::max_bank_head_bytes
+    < (1L << (8 * sizeof(BankEntry::headBytes))),
+    "BankEntry::headBytes can't hold the largest head");
+
+  bool sameEntry(const BankEntry& a, const BankEntry& b) {
+    return a.dirIndex == b.dirIndex && a.format == b.format
+      && a.headBytes == b.headBytes && a.fileSize == b.fileSize
+      && a.modTime == b.modTime && a.modDate == b.modDate;
+  }
+
+  template<typename F>
+  int scanBank(FatFile& root, void* headBegin, bool report, F f) {
+    // calls f(entry, file, head) for each backing track there's room to
+    // cache, in directory order, with the file open at its start, and
+    // returns how many
+    void* dataEnd = NvmManager::dataEnd();
+    int count = 0;
+
+    root.rewind();
+    FatFile file;
+    while (count < BankDir::max_entries && file.openNext(&root, O_RDONLY)) {
+      char name[128];
+      file.getName(name, sizeof(name));
+
+      String nameStr(name);
+      nameStr.toLowerCase();
+
+      const SampleFinder::FileType* type = typeOf(nameStr);
+      dir_t d;
+      if (type && nameStr.startsWith("bg") && file.dirEntry(&d)) {
+        const int perBlock =
+          Samples(nullptr, SampleStream::block_bytes, type->format).length();
+        const int blocks = (headSamples + perBlock - 1) / perBlock;
+        const size_t headBytes = min(size_t(blocks * SampleStream::block_bytes),
+                                     size_t(file.fileSize()));
+        void* headEnd = NvmManager::blockAfter(headBegin, headBytes);
+
+        if (headEnd > dataEnd) {
+          if (report) statusMsgf("no room to cache %s", name);
+        }
+        else {
+          BankEntry e;
+          memset(&e, 0, sizeof(e));     // padding too, as it's flashed
+          e.dirIndex = file.dirIndex();
+          e.format = type->format;
+          e.headBytes = headBytes;
+          e.fileSize = file.fileSize();
+          e.modTime = d.lastWriteTime;
+          e.modDate = d.lastWriteDate;
+          f(e, file, headBegin);
+          count += 1;
+          headBegin = headEnd;
+        }
+      }
+
+      file.close();
+    }
+    return count;
+  }
+
+  class RowWriter {
+    // flashes what's put, a row at a time, so that something as big as the
+    // BankDir (about 2K) never has to be in RAM all at once
+  public:
+    RowWriter(void* d) : dst((uint8_t*)d) { }
+
+    void put(const void* p, size_t n) {
+      const uint8_t* b = (const uint8_t*)p;
+      while (n--) {
+        row[used++] = b ? *b++ : 0;
+        if (used == NvmManager::block_size) flush();
+      }
+    }
+    void zeros(size_t n) { put(nullptr, n); }
+
+    bool flush() {
+      if (used > 0) {
+        memset(row + used, 0, NvmManager::block_size - used);
+        ok = NvmManager::dataWrite(dst, row, NvmManager::block_size) && ok;
+        dst += NvmManager::block_size;
+        used = 0;
+      }
+      return ok;
+    }
+
+  private:
+    uint8_t* dst;
+    alignas(4) uint8_t row[NvmManager::block_size];
+    size_t used = 0;
+    bool ok = true;
+  };
+
+  void buildBank() {
+    void* dirBegin = pairEnd();
+    void* headsBegin = NvmManager::blockAfter(dirBegin, sizeof(BankDir));
+
+    FatFile root;
+    if (!root.open("/")) {
+      errorMsg("open root failed");
+      return;
+    }
+
+    // First, what the bank should hold, against what's there already, an
+    // entry at a time...
+    // NB: The whole BankDir is about 2K, so it's never built in RAM.
+    const BankDir* flashed = bankDir();
+    bool same = flashed == dirBegin;
+    int count = 0;
+    scanBank(root, headsBegin, true,
+      [&](const BankEntry& e, FatFile&, void*) {
+        same = same && count < flashed->count
+          && sameEntry(e, flashed->entries[count]);
+        count += 1;
+      });
+
+    // ...and if it's the same, the flash is left alone.
+    if (same && count == flashed->count) {
+      root.close();
+      statusMsgf("the heads of %d backing tracks are up to date", count);
+      return;
+    }
+
+    RowWriter dir(dirBegin);
+    const uint32_t magic = BankDir::magic_marker;
+    dir.put(&magic, sizeof(magic));
+    dir.put(&count, sizeof(count));
+    dir.zeros(offsetof(BankDir, entries) - sizeof(magic) - sizeof(count));
+
+    scanBank(root, headsBegin, false,
+      [&](const BankEntry& e, FatFile& file, void* head) {
+        copyFileToFlash(head, file, e.headBytes);
+        dir.put(&e, sizeof(e));
+      });
+    root.close();
+
+    dir.zeros((BankDir::max_entries - count) * sizeof(BankEntry));
+    if (!dir.flush()) {
+      errorMsg("error flashing bank");
+    }
+    flashedDir.bank = dirBegin;
+    if (!NvmManager::dataWrite(NvmManager::dataBegin(), (void*)&flashedDir, sizeof(FlashedDir))) {
+      errorMsg("error flashing directory");
+    }
+    statusMsgf("cached the heads of %d backing tracks", count);
+  }
+
+
+  /***
+   *** State of the Sample Finder
+   ***/
 
   const auto c_notFound = CircuitPlayground.strip.Color(  0,   0,   0);
   const auto c_found    = CircuitPlayground.strip.Color(200, 200, 200);
@@ -247,14 +559,20 @@ namespace {
 
 namespace SampleFinder {
 
-  void setup(const char* suffix) {
-    sampleFileSuffix = suffix;
+  void setup(const FileType* types, int count, int sampleRate,
+    int bankHeadSamples)
+  {
+    fileTypes = types;
+    fileTypeCount = count;
+    playRate = sampleRate;
+    headSamples = bankHeadSamples;
 
     loadFlashedSamples();
+    if (!bankDir()) buildBank();
   }
 
   void enter() {
-    findFilePairs(sampleFileSuffix);
+    findFilePairs();
     selectedPair = -1;
   }
 
@@ -276,8 +594,11 @@ namespace SampleFinder {
       if (leftPressed) {
         if (selectedPair >= 0) {
           loadPairToFlash(pairs[selectedPair]);
+          buildBank();    // what's left of the flash may have changed
           enter();
         }
+        else
+          buildBank();    // backing tracks may have been added or changed
       }
     }
   }
@@ -294,6 +615,7 @@ namespace SampleFinder {
         case FilePair::fp_found:      c = c_found;    break;
         case FilePair::fp_loaded:     c = c_loaded;   break;
         case FilePair::fp_tooBig:     c = c_tooBig;   break;
+        case FilePair::fp_wrongRate:  c = c_tooBig;   break;
       }
 
       if (i == selectedPair) {
@@ -315,17 +637,101 @@ namespace SampleFinder {
   }
 
   FlashSamples flashSamples() {
+    const FlashedFile& l = flashedDir.left;
+    const FlashedFile& r = flashedDir.right;
     FlashSamples fs = {
-      Samples(flashedDir.left.data, flashedDir.left.size),
-      Samples(flashedDir.right.data, flashedDir.right.size)
+      Samples(l.data, l.size, Samples::Format(l.header.format)),
+      Samples(r.data, r.size, Samples::Format(r.header.format)),
+      l.header,
+      r.header
       };
 
     statusMsgf("flashSamples left  %08x for %5d", flashedDir.left.data, flashedDir.left.size);
     statusMsgf("flashSamples right %08x for %5d", flashedDir.right.data, flashedDir.right.size);
 
+    // NB: Flashed before the rate was checked, perhaps.
+    auto refuse = [](const FlashedFile& f, Samples& s, const char* side) {
+      if (f.size == 0 || f.header.rate == uint32_t(playRate)) return;
+      errorMsgf("flashed %s sample is at %luHz, but the pads play %dHz",
+        side, (unsigned long)f.header.rate, playRate);
+      s = Samples();
+    };
+    refuse(l, fs.left, "left");
+    refuse(r, fs.right, "right");
+
     flashDirChanged = false;
     return fs;
   }
 
+
+  int bankSize() {
+    const BankDir* b = bankDir();
+    return b ? b->count : 0;
+  }
+
+  Samples bankHead(int i) {
+    const BankEntry* e = bankEntry(i);
+    return e ? Samples(bankHeadData(i), e->headBytes, e->format) : Samples();
+  }
+
+  bool bankHasTail(int i) {
+    const BankEntry* e = bankEntry(i);
+    return e && e->fileSize > e->headBytes;
+  }
+
+  bool openBankTail(int i, FatFile& file) {
+    const BankEntry* e = bankEntry(i);
+    if (!e) return false;
+
+    FatFile root;
+    if (!root.open("/")) {
+      errorMsg("open root failed");
+      return false;
+    }
+    bool opened = file.open(&root, e->dirIndex, O_RDONLY);
+    root.close();
+    if (!opened) return false;
+
+    dir_t d;
+    if (!file.dirEntry(&d)
+        || file.fileSize() != e->fileSize
+        || d.lastWriteTime != e->modTime
+        || d.lastWriteDate != e->modDate
+        || !file.seekSet(e->headBytes)) {
+      // not the file the head was cached from
+      file.close();
+      return false;
+    }
+    return true;
+  }
+
+  bool openStream(FatFile& file, Samples::Format& format) {
+    FatFile root;
+    if (!root.open("/")) {
+      errorMsg("open root failed");
+      return false;
+    }
+
+    bool found = false;
+    while (!found && file.openNext(&root, O_RDONLY)) {
+      char name[128];
+      file.getName(name, sizeof(name));
+
+      String nameStr(name);
+      nameStr.toLowerCase();
+
+      const FileType* type = typeOf(nameStr);
+      if (type && nameStr.startsWith("bg")) {
+        format = type->format;
+        found = true;
+        statusMsgf("streaming file %s", name);
+      }
+      else
+        file.close();
+    }
+    root.close();
+    return found;
+  }
+
 }
 
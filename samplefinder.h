@@ -1,12 +1,24 @@
 #pragma once
 
+#include <SdFat.h>
+
 #include "sound.h"
 #include "types.h"
 
 
 namespace SampleFinder {
 
-  void setup(const char* suffix);
+  struct FileType {
+    const char* suffix;       // lower case, as at the end of the file name
+    Samples::Format format;
+    int rate;                 // unless a sidecar header says otherwise
+  };
+
+  void setup(const FileType* types, int count, int sampleRate,
+    int bankHeadSamples);
+    // sampleRate is what the pads play at: a sample whose header gives any
+    // other is refused, and reported; bankHeadSamples is how much of each
+    // backing track to cache
 
   void enter();
   void exit();
@@ -18,6 +30,8 @@ namespace SampleFinder {
   struct FlashSamples {
     Samples left;
     Samples right;
+    SampleHeader leftHeader;
+    SampleHeader rightHeader;
   };
 
   bool newFlashSamplesAvailable();
@@ -25,5 +39,31 @@ namespace SampleFinder {
     // reset when when flashSamples() is called
 
   FlashSamples flashSamples();
+
+
+  bool openStream(FatFile& file, Samples::Format& format);
+    // opens the backing track, a file named "bg" and one of the suffixes,
+    // to be played from the file system with a SampleStream
+
+  // The bank: every backing track, with its head cached in on-chip flash,
+  // checked whenever the left button is pressed in the sample finder, and
+  // rewritten if any have been added or changed.
+
+  constexpr long max_bank_head_bytes = 0xffff;
+    // most bytes cached of each backing track
+
+  constexpr long bankHeadBytes(long samples) {
+    // bytes cached for a head of samples, at the widest format (16 bit),
+    // rounded up to whole SampleStream blocks
+    return (2 * samples + SampleStream::block_bytes - 1)
+      / SampleStream::block_bytes * SampleStream::block_bytes;
+  }
+
+  int bankSize();
+  Samples bankHead(int i);
+  bool bankHasTail(int i);
+  bool openBankTail(int i, FatFile& file);
+    // opens the file the head was cached from, just past the head; false if
+    // it can't, or if the file has changed since
 }
 
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+/* What a voice needs to know about a sample, beyond the samples themselves:
+ *
+ *    format      - how the samples are stored, a Samples::Format
+ *    rate        - in Hz
+ *    gain        - to bring it to a standard level, with gain_bits fraction
+ *                  bits, so 1.0 is 1 << gain_bits
+ *    startSample - where playing starts, until setPosition() moves it
+ *    loopStart   - where a looped sample loops back to
+ *    loopEnd     - where it loops from; 0 if the sample doesn't loop
+ *
+ * It is stored as is: in a sidecar file (the sample's name plus ".hdr"),
+ * and with each sample flashed. A sample without a sidecar gets defaults()
+ * when it is flashed, so the box only ever works it out once.
+ */
+
+struct SampleHeader {
+  static const uint32_t magic_marker = 0x48534250;    // "PBSH"
+  static const uint8_t current_version = 1;
+  static constexpr int gain_bits = 12;
+
+  uint32_t magic;
+  uint8_t  version;
+  uint8_t  format;
+  uint16_t gain;
+  uint32_t rate;
+  int32_t  startSample;
+  int32_t  loopStart;
+  int32_t  loopEnd;
+
+  bool valid() const {
+    return magic == magic_marker && version == current_version;
+  }
+  bool looped() const { return loopEnd > loopStart; }
+
+  static SampleHeader defaults(uint8_t format, uint32_t rate, int32_t length) {
+    // as the box always did: loop the whole of anything half a second or
+    // longer, at unity gain
+    SampleHeader h;
+    h.magic = magic_marker;
+    h.version = current_version;
+    h.format = format;
+    h.gain = 1 << gain_bits;
+    h.rate = rate;
+    h.startSample = 0;
+    h.loopStart = 0;
+    h.loopEnd = length >= int32_t(rate / 2) ? length : 0;
+    return h;
+  }
+};
+
+static_assert(sizeof(SampleHeader) == 24, "SampleHeader is stored as is");
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <stdint.h>
+#include <type_traits>
+
+/* Smoothing parameters toward a target, as in "Computing discrete
+ * exponentials" in NOTES.md.
+ *
+ * Slew factors are computed at compile time from the slew wanted: reach
+ * within dB of the target after time seconds, stepping at rate per second.
+ * So they follow any change to the sample rate, and never need to be worked
+ * out by hand.
+ *
+ * A Smoother can be stepped toward its target in two ways:
+ *
+ *    slew(q)           - one exponential step, every step
+ *    rampOver(rate, n) - set up a linear ramp, over the next n steps, to
+ *                        where the exponential slew would be after them;
+ *                        then ramp() each step, and rampDone() after
+ *
+ * rampTo(v, n) sets up a linear ramp straight to a new target, v.
+ *
+ * The first costs a multiply each step, the second costs a few multiplies
+ * and a division each block, and an add each step.
+ *
+ * Both stop moving once the value reaches the target exactly, so settled()
+ * can be used to skip the work entirely.
+ */
+
+namespace Smoothing {
+
+  constexpr double ln10 = 2.30258509299404568402;
+
+  constexpr double exp(double x) {
+    // good to double precision, and usable at compile time
+    int halvings = 0;
+    while (x > 0.5 || x < -0.5) { x /= 2; ++halvings; }
+
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 20; ++k) {
+      term *= x / k;
+      sum += term;
+    }
+
+    while (halvings--) sum *= sum;
+    return sum;
+  }
+
+  constexpr double slewFactor(double time, double dB, double rate) {
+    // q, such that q^(time * rate) = 10^(dB/20)
+    return exp(dB / 20.0 * ln10 / (time * rate));
+  }
+}
+
+using Smoothing::slewFactor;
+
+
+template<typename T>
+class SlewRate {
+  // An exponential slew's factor, for one step, and for runs of steps
+public:
+  static constexpr int powers = 12;
+  static constexpr int maxSteps = (1 << powers) - 1;
+
+  constexpr SlewRate(double time, double dB, double rate) : q() {
+    double p = slewFactor(time, dB, rate);
+    for (int k = 0; k < powers; ++k) {
+      q[k] = T(p);
+      p *= p;
+    }
+  }
+
+  T step() const { return q[0]; }
+
+  T over(int steps) const {
+    // the factor for a run of steps, from 1 to maxSteps
+    if (steps > maxSteps) steps = maxSteps;
+    T r = T();
+    bool first = true;
+    for (int k = 0; steps; ++k, steps >>= 1) {
+      if (steps & 1) {
+        r = first ? q[k] : T(r * q[k]);
+        first = false;
+      }
+    }
+    return r;
+  }
+
+private:
+  T q[powers];    // q^(2^k)
+};
+
+
+template<typename T>
+class Smoother {
+public:
+  constexpr Smoother(T v = T())
+    : current(v), target(v), rampEnd(v), acc(0), inc(0)
+    { }
+
+  void set(T t)   { target = t; }                 // slew toward t
+  void jump(T v)  { current = v; target = v; }    // move to v, now
+
+  T value() const     { return current; }
+  T goal() const      { return target; }
+  bool settled() const { return current == target; }
+
+  inline T slew(T q) { return slew(q, q); }
+  inline T slew(T qUp, T qDown) {
+    // NB: Written so that the difference is always positive, so that the
+    //     rounding of the multiply always moves toward the target.
+    if (current < target)       current = target - (target - current) * qUp;
+    else if (target < current)  current = target + (current - target) * qDown;
+    return current;
+  }
+
+  inline void rampOver(const SlewRate<T>& rate, int steps) {
+    const T start = current;
+    const T end = steps > 0 && !settled() ? slew(rate.over(steps)) : current;
+    current = start;
+    startRamp(end, steps);
+  }
+
+  inline void rampTo(T end, int steps) {
+    target = end;
+    startRamp(end, steps);
+  }
+
+  inline T ramp() {
+    acc += inc;
+    current = T::fromInternal(acc >> extra);
+    return current;
+  }
+
+  inline void rampDone() { current = rampEnd; }
+  bool ramping() const { return inc != 0; }
+
+private:
+  // Ramps are kept with extra fraction bits, so that rounding the step
+  // doesn't leave a jump at the end of the ramp.
+  static constexpr int extra = sizeof(T) <= 2 ? 14 : 0;
+
+  // NB: An unsigned 32 bit T, as amp_t is, needs 33 bits for the
+  //     difference of two, so those ramp in 64 bits. Signed ones, as
+  //     delay_t is, don't, and keep to 32 bits, as a 64 bit add a step and
+  //     divide a block cost the M0+ dearly.
+  using internal_t = decltype(T().getInternal());
+  using acc_t = typename std::conditional<
+    (sizeof(T) > 2 && std::is_unsigned<internal_t>::value),
+    int64_t, int32_t>::type;
+
+  static acc_t raw(T v) { return acc_t(v.getInternal()); }
+
+  inline void startRamp(T end, int steps) {
+    rampEnd = end;
+    acc = raw(current) * (1 << extra);
+    inc = steps > 0 && !(end == current)
+      ? (raw(end) - raw(current)) * (1 << extra) / steps : 0;
+  }
+
+  T current;
+  T target;
+
+  T rampEnd;
+  acc_t acc;
+  acc_t inc;
+};
@@ -1,10 +1,24 @@
 #include "sound.h"
+
+#include <atomic>
+#include <string.h>
+
+#include "swar.h"
 #include "types.h"
 
-namespace {
-  inline void silence(sample_t*& buffer, int& count) {
-    while(count--) *buffer++ = SAMPLE_ZERO;
-  }
+int SoundSource::supplyDac(sample_t* buffer, int count, ScratchPool& scratch,
+  int dac_bits)
+{
+  supply(buffer, count, scratch);
+  return Swar::dacBlock(dac_bits, buffer, count);
+}
+
+void SoundSource::supplyAdd(sample_t* buffer, int count, ScratchPool& scratch) {
+  ScratchBuffer buf2(scratch);
+  if (!buf2) return;    // the graph is deeper than DmaDac's scratch pool
+
+  supply(buf2, count, scratch);
+  Swar::addBlock(buffer, buf2, count);
 }
 
 TriangleToneSource::TriangleToneSource()
@@ -21,7 +35,7 @@ void TriangleToneSource::playNote(float freq, float dur) {
   decay = 0.9f * dur / (float)SAMPLE_RATE;
 }
 
-void TriangleToneSource::supply(sample_t* buffer, int count) {
+void TriangleToneSource::supply(sample_t* buffer, int count, ScratchPool&) {
   using sample_fixed_t = SFixed<15, 16>;
 
   while (count--) {
@@ -47,8 +61,264 @@ void TriangleToneSource::supply(sample_t* buffer, int count) {
 }
 
 
+Samples::Samples(const void* d, size_t len, Format f)
+  : data((const uint8_t*)d), fmt(f)
+{
+  switch (fmt) {
+    case linear8:
+      sampleCount = len;
+      break;
+    case imaAdpcm:
+      sampleCount = (len / ImaAdpcm::block_bytes) * ImaAdpcm::block_samples;
+      break;
+    case linear16:
+      sampleCount = len / 2;
+      break;
+    case muLaw8:
+      sampleCount = len;
+      break;
+    case blockFloat8:
+      sampleCount = (len / BlockFloat::block_bytes) * BlockFloat::block_samples;
+      break;
+    default:
+      sampleCount = 0;
+  }
+}
+
+int Samples::blockStart(int n) const {
+  switch (fmt) {
+    case imaAdpcm:  return n - n % ImaAdpcm::block_samples;
+    default:        return n;
+  }
+}
+
+
+void SampleReader::start(const Samples& s, int n, bool l) {
+  start(s, n, 0, l ? s.length() : 0);
+}
+
+void SampleReader::start(const Samples& s, int n, int from, int to) {
+  Mark m;
+  m.next = n;
+  start(s, m, from, to, nullptr);
+}
+
+void SampleReader::start(const Samples& s, const Mark& m, int from, int to,
+  const SampleCues* cues)
+{
+  samples = s;
+  looped = from < to;
+  loopStart = looped ? from : 0;
+  loopEnd = looped ? to : s.length();
+  splice = looped && cues && cues->spliceLength ? cues : nullptr;
+  last = 0;
+  seek(m);
+}
+
+void SampleReader::seek(const Mark& m) {
+  seek(m.next);
+  if (samples.fmt == Samples::imaAdpcm) {
+    blockPos = m.next % ImaAdpcm::block_samples;
+    adpcm = m.adpcm;
+  }
+}
+
+void SampleReader::seek(int n) {
+  next = n;
+  switch (samples.fmt) {
+    case Samples::imaAdpcm:
+      block = samples.data
+        + (n / ImaAdpcm::block_samples) * ImaAdpcm::block_bytes;
+      blockPos = 0;
+      break;
+    case Samples::blockFloat8:
+      block = samples.data
+        + (n / BlockFloat::block_samples) * BlockFloat::block_bytes;
+      blockPos = n % BlockFloat::block_samples;
+      break;
+    default:
+      break;
+  }
+}
+
+void SampleReader::read(int16_t* out, int count) {
+  const int end = loopEnd;
+  const int spliceFrom = splice ? splice->spliceFrom : end;
+
+  while (count > 0) {
+    if (next >= end) {
+      if (!looped) {
+        while (count--) *out++ = last;
+        return;
+      }
+      if (splice)   seek(splice->resume);
+      else          seek(loopStart);
+    }
+
+    if (next >= spliceFrom) {
+      const int n = min(count, end - next);
+      memcpy(out, splice->splice + (next - spliceFrom), n * sizeof(int16_t));
+      next += n;
+      out += n;
+      count -= n;
+      if (n) last = out[-1];
+      continue;
+    }
+
+    const int n = min(count, spliceFrom - next);
+    switch (samples.fmt) {
+      case Samples::linear8:      readLinear8(out, n);      break;
+      case Samples::linear16:     readLinear16(out, n);     break;
+      case Samples::muLaw8:       readMuLaw8(out, n);       break;
+      case Samples::blockFloat8:  readBlockFloat8(out, n);  break;
+      case Samples::imaAdpcm:     readImaAdpcm(out, n);     break;
+    }
+    next += n;
+    out += n;
+    count -= n;
+    if (n) last = out[-1];
+  }
+}
+
+void SampleReader::readLinear8(int16_t* out, int count) {
+  const int8_t* p = (const int8_t*)samples.data + next;
+  while (count--) *out++ = int16_t(*p++ * 256);
+}
+
+void SampleReader::readLinear16(int16_t* out, int count) {
+  // NB: Flashed files start on an NVM block, so the data is aligned.
+  const int16_t* p = (const int16_t*)samples.data + next;
+  while (count--) *out++ = *p++;
+}
+
+void SampleReader::readMuLaw8(int16_t* out, int count) {
+  const uint8_t* p = samples.data + next;
+  const int16_t* linear = MuLaw::tables().linear;
+  while (count--) *out++ = linear[*p++];
+}
+
+void SampleReader::readBlockFloat8(int16_t* out, int count) {
+  while (count > 0) {
+    const int n = min(count, BlockFloat::block_samples - blockPos);
+    const int32_t scale = 1 << min(int(block[0]), BlockFloat::max_shift);
+    const int8_t* p =
+      (const int8_t*)block + BlockFloat::header_bytes + blockPos;
+    for (int k = n; k; --k) *out++ = int16_t(*p++ * scale);
+
+    blockPos += n;
+    count -= n;
+    if (blockPos == BlockFloat::block_samples) {
+      block += BlockFloat::block_bytes;
+      blockPos = 0;
+    }
+  }
+}
+
+void SampleReader::readImaAdpcm(int16_t* out, int count) {
+  while (count > 0) {
+    if (blockPos == 0) {
+      adpcm.header(block);
+      *out++ = int16_t(adpcm.predictor);
+      blockPos = 1;
+      count -= 1;
+      continue;
+    }
+
+    const int n = min(count, ImaAdpcm::block_samples - blockPos);
+    const uint8_t* codes = block + ImaAdpcm::header_bytes;
+    for (int k = blockPos - 1, end = k + n; k < end; ++k)
+      *out++ = adpcm.decode((codes[k >> 1] >> ((k & 1) * 4)) & 0x0f);
+
+    blockPos += n;
+    count -= n;
+    if (blockPos == ImaAdpcm::block_samples) {
+      block += ImaAdpcm::block_bytes;
+      blockPos = 0;
+    }
+  }
+}
+
+
+namespace {
+  void skipTo(SampleReader& r, int n) {
+    int16_t discard[32];
+    while (r.position() < n)
+      r.read(discard, min(int(sizeof(discard) / sizeof(discard[0])),
+        n - r.position()));
+  }
+
+  void readFrom(SampleReader& r, const Samples& s, int n) {
+    // NB: Reading can only start at a block, so decode up to n.
+    r.start(s, s.blockStart(n), false);
+    skipTo(r, n);
+  }
+
+  bool loopOf(const Samples& s, const SampleHeader& h,
+    int& loopStart, int& loopEnd)
+  {
+    // the loop h gives, fitted to s; empty if it doesn't loop
+    // NB: Anything that playing can start at must start a block.
+    const int length = s.length();
+    loopEnd = clamp(int(h.loopEnd), 0, length);
+    loopStart = s.blockStart(clamp(int(h.loopStart), 0, length));
+    if (loopStart < loopEnd) return true;
+    loopStart = loopEnd = 0;
+    return false;
+  }
+}
+
+void SampleCues::build(const Samples& s, const SampleHeader& h) {
+  int loopStart, loopEnd;
+  loopOf(s, h, loopStart, loopEnd);
+
+  spliceLength = 0;
+  spliceFrom = loopEnd;
+  for (auto& m : starts) m.next = 0;
+  if (loopStart >= loopEnd) return;
+
+  SampleReader r;
+
+  // the tail, faded out as the head of the loop fades in
+  const int n = min(splice_max, (loopEnd - loopStart) / 2);
+  readFrom(r, s, loopEnd - n);
+  r.read(splice, n);
+  readFrom(r, s, loopStart);
+  for (int i = 0; i < n; ++i) {
+    int16_t head;
+    r.read(&head, 1);
+    splice[i] = int16_t(
+      (int32_t(splice[i]) * (n - i) + int32_t(head) * (i + 1)) / (n + 1));
+  }
+  resume = r.mark();
+  spliceFrom = loopEnd - n;
+  spliceLength = n;
+
+  for (int c = 0; c < start_count; ++c) {
+    const int at = int(int64_t(spliceFrom) * c / start_count);
+    const int limit = min(at + zero_search, spliceFrom);
+    readFrom(r, s, at);
+    starts[c] = r.mark();
+
+    SampleReader::Mark prevMark = r.mark();
+    int16_t prev;
+    r.read(&prev, 1);
+    while (prev != 0 && r.position() < limit) {
+      const SampleReader::Mark m = r.mark();
+      int16_t v;
+      r.read(&v, 1);
+      if ((prev < 0) != (v < 0) || v == 0) {
+        starts[c] = abs(v) < abs(prev) ? m : prevMark;
+        break;
+      }
+      prevMark = m;
+      prev = v;
+    }
+  }
+}
+
+
 SampleSourceBase::SampleSourceBase()
-  : nextSample(samples.length())
+  : nextSample(samples.length()), restart(false)
   { }
 
 void SampleSourceBase::load(const Samples& s) {
@@ -59,137 +329,334 @@ void SampleSourceBase::load(const Samples& s) {
 void SampleSourceBase::play(float ampf) {
   amp = ampf;
   nextSample = 0;
+  restart = true;
 }
 
-template<>
-void SampleSource<int(SAMPLE_RATE)>::supply(sample_t* buffer, int count) {
-  while (nextSample < samples.length() && count) {
-    count -= 1;
-    *buffer++ = sample_t(samples[nextSample++]*amp);
-  }
-  silence(buffer, count);
+SampleStream::SampleStream()
+  : format(Samples::linear8), active(false), atEnd(true), startCount(0),
+    filled(0), taken(0), headLeft(0), left(0), last(0), starved(false)
+{
+  resetStats();
 }
 
-template<>
-void SampleSource<int(SAMPLE_RATE/2)>::supply(sample_t* buffer, int count) {
-  comp_t a = amp/2;
+void SampleStream::reset(Samples::Format fmt) {
+  active = false;     // the interrupt won't touch the ring until it's set
+
+  format = fmt;
+  filled = 0;
+  taken = 0;
+  atEnd = false;
+  headLeft = 0;
+  left = 0;
+  last = 0;
+  starved = false;
+}
 
-  while (nextSample < samples.length() && count) {
-    count -= 2;
-    comp_t v = comp_t(samples[nextSample++]);
-    comp_t w = nextSample < samples.length() ? comp_t(samples[nextSample]) : v;
+void SampleStream::go() {
+  released();
+  startCount = startCount + 1;
+  active = true;
+}
 
-    *buffer++ = sample_t((v + v) * a);
-    *buffer++ = sample_t((v + w) * a);
-  }
-  silence(buffer, count);
+void SampleStream::start(const Samples& head, bool tail) {
+  reset(head.format());
+  reader.start(head, 0, false);
+  headLeft = head.length();
+  atEnd = !tail;
+  if (tail) tailCount += 1;
+  go();
 }
 
-template<>
-void SampleSource<int(SAMPLE_RATE/4)>::supply(sample_t* buffer, int count) {
-  comp_t a = amp/4;
+void SampleStream::stop() {
+  active = false;
+}
+
+void SampleStream::resetStats() {
+  underrunCount = 0;
+  missedCount = 0;
+  lowestReady = slots;
+  lateCount = 0;
+  tailCount = 0;
+}
+
+void SampleStream::released() {
+  // NB: The interrupt can run between any two instructions of loop(). This
+  //     keeps the compiler from moving the writes to a slot, or the reset of
+  //     the interrupt's state, after the store that hands them over.
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+}
+
+void SampleStream::read(int16_t* out, int count) {
+  if (headLeft > 0) {
+    const int n = min(count, headLeft);
+    reader.read(out, n);
+    out += n;
+    count -= n;
+    if (n) last = out[-1];
+
+    headLeft -= n;
+    if (headLeft == 0 && !atEnd && filled == taken) lateCount += 1;
+  }
+
+  while (count > 0) {
+    if (left == 0) {
+      const unsigned ready = filled - taken;
+      if (ready == 0) {
+        if (!atEnd) {
+          if (!starved) underrunCount += 1;
+          starved = true;
+          missedCount += count;
+        }
+        while (count--) *out++ = last;
+        return;
+      }
+      starved = false;
+      if (!atEnd && int(ready) - 1 < lowestReady) lowestReady = ready - 1;
+
+      const Slot& s = ring[taken % slots];
+      Samples block(s.data, s.bytes, format);
+      reader.start(block, 0, false);
+      left = block.length();
+      if (left == 0) {
+        // too short a block to hold a sample
+        taken = taken + 1;
+        continue;
+      }
+    }
 
-  while (nextSample < samples.length() && count) {
-    count -= 4;
-    comp_t v = comp_t(samples[nextSample++]);
-    comp_t w = nextSample < samples.length() ? comp_t(samples[nextSample]) : v;
+    const int n = min(count, left);
+    reader.read(out, n);
+    out += n;
+    count -= n;
+    if (n) last = out[-1];
 
-    *buffer++ = sample_t((v + v + v + v) * a);
-    *buffer++ = sample_t((v + v + v + w) * a);
-    *buffer++ = sample_t((v + v + w + w) * a);
-    *buffer++ = sample_t((v + w + w + w) * a);
+    left -= n;
+    if (left == 0) taken = taken + 1;    // hands the slot back to fill()
   }
-  silence(buffer, count);
 }
 
+
 SampleGateSourceBase::SampleGateSourceBase()
-  : looped(false), startSample(0), nextSample(0), amp(0), ampTarget(0)
+  : live(0), playing(0),
+    looped(false), loopStart(0), loopEnd(0), gain(1),
+    startSample(0), position(0), cues(nullptr), startCue(-1),
+    nextSample(0), restart(true),
+    amp(amp_t(0)), fadeGoal(0)
   { }
 
 void SampleGateSourceBase::load(const Samples& s) {
-  samples = s;
-  looped = samples.length() >= sampleRate() / 2;
-  startSample = 0;
-  nextSample = 0;
+  load(s, SampleHeader::defaults(s.format(), sampleRate(), s.length()));
 }
+
+void SampleGateSourceBase::load(const Samples& s, const SampleHeader& h,
+  const SampleCues* c)
+{
+  settle();
+
+  const int next = 1 - live;
+  Bank& b = banks[next];
+  b.samples = s;
+  b.header = h;
+  b.looped = loopOf(s, h, b.loopStart, b.loopEnd);
+  b.gain = comp_t::fromInternal(
+    int32_t(h.gain) << (comp_t::FractionSize - SampleHeader::gain_bits));
+  const int length = s.length();
+  b.startSample = s.blockStart(clamp(int(h.startSample), 0, length));
+  if (b.looped && b.startSample >= b.loopEnd) b.startSample = b.loopStart;
+  b.cues = c;
+
+  std::atomic_signal_fence(std::memory_order_release);
+  live = next;
+}
+
+void SampleGateSourceBase::settle() {
+  // NB: A voice that isn't sounding may not be supplied, so take the bank
+  //     up here. If the interrupt does too, it takes up the same one.
+  //     One that is sounding is taken up by the render, within the ring's
+  //     few buffers; if the render isn't running, it never would be, so
+  //     after settle_ms it's taken up here anyway: a click, not a hang.
+  constexpr millis_t settle_ms = 50;
+  const millis_t began = millis();
+  while (live != playing) {
+    if (!sounding())
+      adopt();
+    else if (millis() - began >= settle_ms) {
+      noInterrupts();
+      if (live != playing) adopt();
+      interrupts();
+    }
+  }
+}
+
+void SampleGateSourceBase::adopt() {
+  const int l = live;
+  const Bank& b = banks[l];
+  samples = b.samples;
+  looped = b.looped;
+  loopStart = b.loopStart;
+  loopEnd = b.loopEnd;
+  gain = b.gain;
+  startSample = b.startSample;
+  cues = b.cues;
+  startCue = -1;
+  loaded(b.header);
+
+  nextSample = startSample;
+  restart = true;
+  playing = l;
+}
+
 void SampleGateSourceBase::gate(float a) {
-  if (ampTarget == amp_t(0))
-    nextSample = startSample;
+  if (amp.goal() == amp_t(0)) {
+    nextSample = startMark().next;
+    restart = true;
+  }
 
-  ampTarget = amp_t(a);
+  amp.set(amp_t(a));
 }
 
 void SampleGateSourceBase::gateOff() {
-  ampTarget = amp_t(0);
+  amp.set(amp_t(0));
+}
+
+void SampleGateSourceBase::retrigger(float a) {
+  nextSample = startMark().next;
+  restart = true;
+  amp.jump(amp_t(0));
+  amp.set(amp_t(a));
+}
+
+bool SampleGateSourceBase::sounding() const {
+  constexpr amp_t silent(0.0001);    // -80dB
+
+  if (samples.length() == 0) return false;
+  if (!looped && nextSample >= samples.length()) return false;
+  return amp.goal() > amp_t(0) || amp.value() > silent;
 }
 
 void SampleGateSourceBase::setPosition(float p) {
-  int l = samples.length();
+  position = p;
   if (!looped) return;
 
-  startSample = clamp(int(float(l)*p), 0, l - 1);
+  if (cues) {
+    startCue = clamp(int(float(SampleCues::start_count)*p),
+      0, SampleCues::start_count - 1);
+    return;
+  }
+  startSample = samples.blockStart(clamp(int(float(loopEnd)*p), 0, loopEnd - 1));
 }
 
-// TODO: Write the SAMPLE_RATE version of SampleGateSource::supply()
 
-template<>
-void SampleGateSource<int(SAMPLE_RATE/2)>::supply(sample_t* buffer, int count) {
-  if (samples.length() > 0) {
-    while (count) {
-      if (!looped && nextSample >= samples.length()) break;
-      SFixed<15, 16> v(samples[nextSample++]);
-      if (looped && nextSample >= samples.length()) nextSample = 0;
+namespace {
+  constexpr double sinSeries(double x) {
+    // for 0 <= x <= pi, usable at compile time
+    double s = 0;
+    double term = x;
+    for (int n = 1; n < 32; n += 2) {
+      s += term;
+      term *= -x * x / ((n + 1) * (n + 2));
+    }
+    return s;
+  }
 
-      SFixed<15, 16> w(samples[nextSample]);
-      SFixed<15, 16> a(amp);
-      a /= 2;
+  struct GrainWindow {
+    // Hann, sin^2, with 15 fraction bits
+    static constexpr int size = 1024;
+    uint16_t w[size];
 
-      *buffer++ = sample_t((v + v) * a);
-      *buffer++ = sample_t((v + w) * a);
-      count -= 2;
+    constexpr GrainWindow() : w() {
+      for (int i = 0; i < size; ++i) {
+        const double s = sinSeries(PI * i / size);
+        w[i] = uint16_t(32768.0 * s * s + 0.5);
+      }
+    }
+  };
 
-      /*
-        slew = (t * SR/2) root (-20dB)
-      */
-      constexpr amp_t slewUp(  0.92316169902);   // 1.2ms
-      constexpr amp_t slewDown(0.99887191858);   // 85ms
+  constexpr GrainWindow grainWindow;
+}
 
-      if (amp < ampTarget)  amp = ampTarget - (ampTarget - amp) * slewUp;
-      else                  amp = ampTarget + (amp - ampTarget) * slewDown;
-    }
+GranularSourceBase::GranularSourceBase()
+  : grainLength(0), interval(0), spread(0), windowStep(0), untilNext(0),
+    drift(0), speed(0), noise(12345), started(0), dropped(0)
+{
+  for (auto& g : grains) g.left = 0;
+}
+
+void GranularSourceBase::loaded(const SampleHeader& h) {
+  const int rate = sampleRate();
+  interval = max(rate * grain_ms / 1000 / max_grains, 1);
+  grainLength = interval * max_grains;
+  spread = rate * spread_ms / 1000;
+  windowStep = (uint32_t(GrainWindow::size) << 16) / grainLength;
+  for (auto& g : grains) g.left = 0;
+}
+
+void GranularSourceBase::startGrains() {
+  for (auto& g : grains) g.left = 0;
+  untilNext = 0;
+  drift = 0;
+}
+
+void GranularSourceBase::startGrain() {
+  Grain* g = nullptr;
+  for (auto& h : grains)
+    if (h.left == 0) { g = &h; break; }
+  if (!g) {
+    dropped += 1;
+    return;
   }
-  silence(buffer, count);
-}
-
-template<>
-void SampleGateSource<int(SAMPLE_RATE/4)>::supply(sample_t* buffer, int count) {
-  if (samples.length() > 0) {
-    while (count) {
-      if (!looped && nextSample >= samples.length()) break;
-      SFixed<15, 16> v(samples[nextSample++]);
-      if (looped && nextSample >= samples.length()) nextSample = 0;
-
-      SFixed<15, 16> w(samples[nextSample]);
-      SFixed<15, 16> a(amp);
-      a /= 4;
-
-      *buffer++ = sample_t((v + v + v + v) * a);
-      *buffer++ = sample_t((v + v + v + w) * a);
-      *buffer++ = sample_t((v + v + w + w) * a);
-      *buffer++ = sample_t((v + w + w + w) * a);
-      count -= 4;
-
-      /*
-        slew = (t * SR/4) root (-20dB)
-      */
-      constexpr amp_t slewUp(  0.85222752254f);   // 1.2ms
-      constexpr amp_t slewDown(0.99774510973f);   // 85ms
-
-      if (amp < ampTarget)  amp = ampTarget - (ampTarget - amp) * slewUp;
-      else                  amp = ampTarget + (amp - ampTarget) * slewDown;
+
+  // NB: A looped sample is played round its loop, so grains can start
+  //     anywhere in it; otherwise only where a whole grain fits.
+  const int length = samples.length();
+  const int range = looped ? loopEnd : max(length - grainLength, 1);
+  noise = noise * 1664525 + 1013904223;
+  int at = int(position * range + drift)
+    + int((noise >> 16) % uint32_t(2 * spread + 1)) - spread;
+  at %= range;
+  if (at < 0) at += range;
+  drift += speed * interval;
+  if (drift >= range) drift -= range;
+
+  SampleReader::Mark m;
+  m.next = samples.blockStart(at);
+  if (looped) g->reader.start(samples, m, loopStart, loopEnd, cues);
+  else        g->reader.start(samples, m, 0, 0, nullptr);
+  skipTo(g->reader, at);
+    // NB: For ADPCM, at most a block to decode, once a grain.
+
+  g->left = grainLength;
+  g->phase = 0;
+  started += 1;
+}
+
+void GranularSourceBase::renderGrains(int32_t* mix, int count) {
+  const bool starting = amp.goal() > amp_t(0);
+
+  while (count > 0) {
+    if (starting && untilNext <= 0) {
+      startGrain();
+      untilNext = interval;
     }
+    const int n = starting ? min(count, untilNext) : count;
+
+    for (auto& g : grains) {
+      const int m = min(n, g.left);
+      if (m == 0) continue;
+
+      int16_t tap[chunk];
+      g.reader.read(tap, m);
+      uint32_t phase = g.phase;
+      for (int i = 0; i < m; ++i, phase += windowStep)
+        mix[i] += int32_t(tap[i]) * grainWindow.w[phase >> 16] >> 15;
+      g.phase = phase;
+      g.left -= m;
+    }
+
+    untilNext -= n;
+    mix += n;
+    count -= n;
   }
-  silence(buffer, count);
 }
 
 
@@ -197,108 +664,105 @@ MixSource::MixSource(SoundSource& _s1, SoundSource& _s2)
   : s1(_s1), s2(_s2)
   { }
 
-void MixSource::supply(sample_t* buffer, int count) {
-  s1.supply(buffer, count);
+void MixSource::supply(sample_t* buffer, int count, ScratchPool& scratch) {
+  s1.supply(buffer, count, scratch);
+  s2.supplyAdd(buffer, count, scratch);
+}
 
-  sample_t* buf2 = (sample_t*)(alloca(sizeof(sample_t) * count));
-  s2.supply(buf2, count);
+int MixSource::scratchDepth() const {
+  return max(s1.scratchDepth(), s2.scratchDepthAdd());
+}
 
-  for (int i = 0; i < count; ++i) {
-    sample_t s = (*buffer + *buf2++);
-    *buffer++ = s;
+namespace {
+  constexpr double tanSeries(double x) {
+    // for 0 <= x <= pi/4, usable at compile time
+    double s = 0, c = 0;
+    double term = 1;
+    for (int n = 0; n < 24; ++n) {
+      if (n % 2 == 0) c += (n % 4 == 0 ? term : -term);
+      else            s += (n % 4 == 1 ? term : -term);
+      term *= x / (n + 1);
+    }
+    return s / c;
   }
+
+  struct FreqTable {
+    // g = tan(pi * freq / SAMPLE_RATE), at even steps of freq up to freqMax
+    static constexpr int steps = 64;
+    float g[steps + 1];
+
+    constexpr FreqTable() : g() {
+      for (int i = 0; i <= steps; ++i)
+        g[i] = float(tanSeries(PI * FilterSource::freqMax * i / steps
+                                 / SAMPLE_RATE));
+    }
+  };
+
+  constexpr FreqTable freqTable;
 }
 
 FilterSource::FilterSource(SoundSource& _in)
-  : in(_in), b0(0), b1(0)
+  : in(_in), live(0), mode(lowPass), s1(0), s2(0)
 {
   setFreqAndQ(2540.0f, 0.2f);
+  g.jump(pending[live].g);
+  kHalf.jump(pending[live].kHalf);
+  d.jump(pending[live].d);
 }
 
 void FilterSource::setFreqAndQ(float freq, float q)
 {
-  constexpr float freq_max = SAMPLE_RATE / 6.0f;
-  freq = min(freq, freq_max);
+  freq = clamp(freq, 0.0f, freqMax);
   q = clamp(q, 0.0f, 0.9f);
 
-  constexpr float c = PI / SAMPLE_RATE;
-  constexpr bool accurate = true;
-
-  float ff;
+  float pos = freq * (FreqTable::steps / freqMax);
+  int i = min(int(pos), FreqTable::steps - 1);
+  float gf = freqTable.g[i] + (freqTable.g[i + 1] - freqTable.g[i]) * (pos - i);
 
-  if (accurate)
-    ff = 2.0f * sinf(c * freq);
-  else {
-    constexpr float d = 2.0f * c;
-    ff = d * freq;
-    if (ff > 2.0f) ff = 2.0f;
-  }
+  float k = 2.0f - 2.0f * q;    // from Q = 0.5 up to Q = 5
+  float df = 1.0f / (1.0f + k * gf + gf * gf);
 
-  // q needs to roll off as it approaches freq_max or "bad things"(tm) happen!
-  constexpr float fullQfreq = 1000.0f;
-  q *= (1.0f - (q - fullQfreq)/(freq_max - fullQfreq));
+  constexpr float coef_max = 65535.0f / 65536.0f;
+  const int next = 1 - live;
+  Coefficients& c = pending[next];
+  c.g = coef_t(min(gf, coef_max));
+  c.kHalf = coef_t(min(k / 2.0f, coef_max));
+  c.d = coef_t(min(df, coef_max));
 
-  f = ff;
-  fb = q + q/(1.0f - ff);
+  std::atomic_signal_fence(std::memory_order_release);
+  live = next;
 }
 
-void FilterSource::supply(sample_t* buffer, int count) {
-  in.supply(buffer, count);
-
-  while (count--) {
-    sample_t s_in = *buffer;
+void FilterSource::supply(sample_t* buffer, int count, ScratchPool& scratch) {
+  in.supply(buffer, count, scratch);
 
-    b0 = b0 + f * (s_in - b0 + fb * (b0 - b1));
-    b1 = b1 + f * (b0 - b1);
-
-    *buffer++ = b1;
-  }
+  Block b(*this, count);
+  for (; count--; ++buffer)
+    *buffer = b.step(*buffer);
+  b.done();
 }
 
-DelaySource::DelaySource(SoundSource& _in)
+DelaySourceBase::DelaySourceBase(SoundSource& _in)
   : in(_in),
-  delay(baseDelaySamples), delayTarget(delay),
-  feedback(0.35f), feedbackTarget(feedback),
-  writeP(0)
- {
-   for (int i = 0; i < maxDelaySamples; i++) tank[i] = sample_t(0);
- }
-
-void DelaySource::setFeedback(float f) {
+  delay(delay_t(baseDelaySamples)), feedback(sample_t(0.35f))
+  { }
+
+const SlewRate<DelaySourceBase::delay_t>
+  DelaySourceBase::delaySlew(0.500, -24, SAMPLE_RATE);
+const SlewRate<sample_t>
+  DelaySourceBase::feedbackSlew(0.002, -24, SAMPLE_RATE);
+
+void DelaySourceBase::setFeedback(float f) {
   constexpr sample_t f_min(0.0f);
   constexpr sample_t f_max(0.995f);
 
-  feedbackTarget = clamp(sample_t(f), f_min, f_max);
+  feedback.set(clamp(sample_t(f), f_min, f_max));
 }
 
-void DelaySource::setDelayMod(float d) {
+void DelaySourceBase::setDelayMod(float d) {
   constexpr delay_t d_min(1);
   constexpr delay_t d_max(maxDelaySamples);
   constexpr delay_t d_base(baseDelaySamples);
 
-  delayTarget = clamp(delay_t(d) * d_base, d_min, d_max);
-}
-
-void DelaySource::supply(sample_t* buffer, int count) {
-  in.supply(buffer, count);
-  while (count--) {
-    int readP = writeP + int(delay);
-    sample_t v = tank[readP % maxDelaySamples];
-    sample_t in = *buffer;
-
-    constexpr sample_t two(2.0);
-    constexpr sample_t negtwo(-2.0);
-    sample_t w = in + feedback * v;
-    w = clamp(w, negtwo, two);
-
-    tank[writeP] = w;
-    writeP = (writeP > 0 ? writeP : maxDelaySamples) - 1;
-    *buffer++ = w;
-
-    constexpr delay_t  d_exp(0.99988487737);  // -24dB over 500ms @ 48kHz
-    constexpr sample_t f_exp(0.97162795158);  // -24dB over 2ms @ 48kHz
-
-    delay = delayTarget - (delayTarget - delay) * d_exp;
-    feedback = feedbackTarget - (feedbackTarget - feedback) * f_exp;
-  }
+  delay.set(clamp(delay_t(d) * d_base, d_min, d_max));
 }
@@ -2,22 +2,111 @@
 
 #include <FixedPoints.h>
 
-using sample_t = SFixed<2, 13>;
-
-constexpr sample_t SAMPLE_ZERO = sample_t(0);
-constexpr sample_t SAMPLE_UNIT = sample_t(1);
-constexpr sample_t SAMPLE_POS_ONE = sample_t(1.0);
-constexpr sample_t SAMPLE_NEG_ONE = sample_t(-1.0);
+#include "adpcm.h"
+#include "blockfloat.h"
+#include "delaytank.h"
+#include "interpolate.h"
+#include "mulaw.h"
+#include "sample.h"
+#include "sampleheader.h"
+#include "smoother.h"
+#include "swar.h"
+#include "types.h"
 
 constexpr float SAMPLE_RATE_TARGET = 48000.0;
 constexpr long SAMPLE_RATE_CPU_DIVISOR = F_CPU / (long)SAMPLE_RATE_TARGET;
-constexpr float SAMPLE_RATE = (float)F_CPU / (float)SAMPLE_RATE_CPU_DIVISOR;
+constexpr float DAC_RATE = (float)F_CPU / (float)SAMPLE_RATE_CPU_DIVISOR;
+
+#ifndef PBOX_ENGINE_DIVISOR
+#define PBOX_ENGINE_DIVISOR 1
+#endif
+constexpr int ENGINE_DIVISOR = PBOX_ENGINE_DIVISOR;
+  // The sound graph runs at DAC_RATE / ENGINE_DIVISOR, and DmaDac brings it
+  // up to the DAC_RATE with one Upsampler. At 2, the graph runs at 24kHz,
+  // for about half the cycles, and the delay tank holds twice the time;
+  // but nothing above 12kHz is left, and the filter tops out at 4kHz.
+  // Samples must then be at the graph's rate or below.
+constexpr float SAMPLE_RATE = DAC_RATE / ENGINE_DIVISOR;
+
+
+class ScratchPool {
+public:
+  ScratchPool(sample_t* storage, int buffers, int bufferCount)
+    : storage(storage), buffers(buffers), bufferCount(bufferCount),
+      used(0), usedMax(0)
+    { }
+
+  int size() const      { return buffers; }
+  int highWater() const { return usedMax; }
+    // most buffers ever borrowed at once
+
+private:
+  friend class ScratchBuffer;
+
+  sample_t* borrow() {
+    if (used >= buffers) return nullptr;
+    sample_t* b = storage + used * bufferCount;
+    used += 1;
+    if (used > usedMax) usedMax = used;
+    return b;
+  }
+  void giveBack() { used -= 1; }
+
+  sample_t* const storage;
+  const int buffers;
+  const int bufferCount;
+  int used;
+  int usedMax;
+};
+
+class ScratchBuffer {
+  // A buffer borrowed from the pool for as long as this is in scope.
+  // Borrows are strictly nested, so the pool is just a stack.
+public:
+  ScratchBuffer(ScratchPool& p) : pool(p), buffer(p.borrow()) { }
+  ~ScratchBuffer() { if (buffer) pool.giveBack(); }
+
+  operator sample_t*() const { return buffer; }
+
+private:
+  ScratchPool& pool;
+  sample_t* const buffer;
+};
 
 
 class SoundSource {
 public:
-  virtual void supply(sample_t* buffer, int count) = 0;
+  virtual void supply(sample_t* buffer, int count, ScratchPool& scratch) = 0;
     // NB: Will get called at interrupt time!
+
+  virtual void supplyAdd(sample_t* buffer, int count, ScratchPool& scratch);
+    // Like supply(), but adds into the buffer. By default, this borrows a
+    // scratch buffer, but sources that can add in place should override it.
+
+  virtual int supplyDac(sample_t* buffer, int count, ScratchPool& scratch,
+    int dac_bits = DAC_BITS);
+    // Like supply(), but leaves dac_bits DAC values in the buffer, which
+    // must be 4 byte aligned, and returns how many samples were clipped. By
+    // default, this converts in a second pass, but sources that end in a
+    // loop over every sample should override it to convert there.
+
+  virtual int scratchDepth() const { return 0; }
+  virtual int scratchDepthAdd() const { return 1 + scratchDepth(); }
+    // Most scratch buffers supply() and supplyAdd() will borrow at once,
+    // including those borrowed by the sources they pull from.
+};
+
+
+struct StoreSamples {
+  static inline void put(sample_t*& b, sample_t v)  { *b++ = v; }
+  static inline void silence(sample_t* b, int count) {
+    while (count--) *b++ = SAMPLE_ZERO;
+  }
+};
+
+struct AddSamples {
+  static inline void put(sample_t*& b, sample_t v)  { *b = *b + v; ++b; }
+  static inline void silence(sample_t* b, int count) { }
 };
 
 
@@ -27,7 +116,7 @@ public:
 
   void playNote(float freq, float dur);
 
-  virtual void supply(sample_t* buffer, int count);
+  virtual void supply(sample_t* buffer, int count, ScratchPool&);
 
 private:
   UFixed<0, 32> theta;  // current location in cycle
@@ -39,19 +128,112 @@ private:
 
 class Samples {
 public:
-  Samples() : samples(nullptr), sampleCount(0) { }
-  Samples(void* data, size_t len)
-    : samples((sample_t*)data), sampleCount(len / sizeof(sample_t)) { }
+  enum Format : uint8_t {
+    linear8,      // SFixed<0,7>, a byte each
+    imaAdpcm,     // four bits each, in blocks, see adpcm.h
+    linear16,     // SFixed<0,15>, two bytes each, little endian
+    muLaw8,       // a byte each, see mulaw.h
+    blockFloat8,  // a byte each, in blocks with a shift, see blockfloat.h
+  };
+
+  Samples() : data(nullptr), sampleCount(0), fmt(linear8) { }
+  Samples(const void* data, size_t len, Format f = linear8);
+
+  using sample_t = SFixed<0, 7>;    // as stored in linear8
 
-  using sample_t = SFixed<0, 7>;
+  int    length() const { return sampleCount; }
+  Format format() const { return fmt; }
 
-  sample_t operator[](int n) const { return samples[n]; }
-  int      length()          const { return sampleCount; }
+  int blockStart(int n) const;
+    // the start of the block sample n is in: playing can only start at
+    // the start of a block
 
 private:
-  sample_t* samples;
+  friend class SampleReader;
+
+  const uint8_t* data;
   int sampleCount;
+  Format fmt;
+};
+
+struct SampleCues;
+
+class SampleReader {
+  // Reads samples in order, decoding them, as 16 bit values (SFixed<0,15>).
+  // The format is dispatched once per read(), not once per sample.
+public:
+  SampleReader()
+    : looped(false), loopStart(0), loopEnd(0), splice(nullptr),
+      next(0), last(0) { }
 
+  struct Mark {
+    // a position, and the decoder state there, so that reading can start
+    // at any sample, not just at the start of a block
+    int next;
+    ImaAdpcm::State adpcm;
+  };
+  Mark mark() const { return { next, adpcm }; }
+  int position() const { return next; }
+
+  void start(const Samples& s, int n, bool looped);
+    // n must be the start of a block
+  void start(const Samples& s, int n, int loopStart, int loopEnd);
+    // loops from loopEnd back to loopStart, which must start a block
+  void start(const Samples& s, const Mark& m, int loopStart, int loopEnd,
+    const SampleCues* cues);
+    // from m, and if cues has a splice for this loop, through it
+
+  void read(int16_t* out, int count);
+    // Past the end, wraps around if looped, otherwise repeats the last
+    // sample.
+
+private:
+  void seek(int n);
+  void seek(const Mark& m);
+  void readLinear8(int16_t* out, int count);
+  void readLinear16(int16_t* out, int count);
+  void readMuLaw8(int16_t* out, int count);
+  void readBlockFloat8(int16_t* out, int count);
+  void readImaAdpcm(int16_t* out, int count);
+
+  Samples samples;
+  bool looped;
+  int loopStart;
+  int loopEnd;      // or the end of the samples, if not looped
+  const SampleCues* splice;   // if looping through one
+  int next;
+  int16_t last;
+
+  const uint8_t* block;     // for formats in blocks, the one being read
+  int blockPos;             // and the position in it
+  ImaAdpcm::State adpcm;
+};
+
+struct SampleCues {
+  // Where playing a looped sample can start, and how it loops, worked out
+  // once at load, and shared by all the voices playing it.
+  //
+  // The splice replaces the last samples before loopEnd with a crossfade
+  // into those from loopStart, and reading carries on from just past them,
+  // at resume. So the loop has no seam, and reading it is still a plain
+  // copy. The starts are for setPosition(): each is the zero crossing
+  // nearest after an even division of the loop, so a retrigger there
+  // starts from silence.
+
+  static constexpr int splice_max = 128;      // samples: 5.3ms at 24kHz
+  static constexpr int start_count = 32;
+  static constexpr int zero_search = 256;     // samples past each division
+
+  int spliceFrom;       // loopEnd - spliceLength
+  int spliceLength;     // 0 if the sample doesn't loop
+  SampleReader::Mark resume;
+  int16_t splice[splice_max];
+
+  SampleReader::Mark starts[start_count];
+
+  SampleCues() : spliceFrom(0), spliceLength(0) { }
+  void build(const Samples& s, const SampleHeader& h);
+    // for the loop a voice would play, given h
 };
 
 class SampleSourceBase : public SoundSource {
@@ -62,52 +244,873 @@ public:
 
 protected:
   Samples samples;
+  SampleReader reader;
   int nextSample;
+  volatile bool restart;
 
   using comp_t = SFixed<15, 16>;
   comp_t amp;
 };
 
 template<int sample_rate>
+constexpr int upsampleFactor() {
+  static_assert(int(SAMPLE_RATE) % sample_rate == 0,
+    "sample rate must divide SAMPLE_RATE");
+  return int(SAMPLE_RATE) / sample_rate;
+}
+
+constexpr int32_t sampleTapToComp = 1 << (SFixed<15, 16>::FractionSize - 15);
+  // from the 16 bit values SampleReader reads
+
+template<typename Interp>
+class SampleWindow {
+  // The samples the interpolator needs from before the next one to be read,
+  // carried over from one block to the next.
+public:
+  // Reader is a SampleReader, or anything else with the same read()
+
+  template<typename Reader>
+  void begin(Reader& reader) {
+    // reader has just started at the first sample to be played
+    int16_t w[Interp::taps];
+    reader.read(w + Interp::before, size - Interp::before);
+    for (int k = 0; k < Interp::before; ++k) w[k] = w[Interp::before];
+    for (int k = 0; k < size; ++k) window[k] = w[k];
+  }
+
+  template<typename Reader, typename F>
+  inline void run(Reader& reader, int steps, F& f) {
+    // calls f(taps) for each of steps more samples
+    while (steps > 0) {
+      const int n = min(steps, chunk_steps);
+      int16_t taps[size + chunk_steps];
+      for (int k = 0; k < size; ++k) taps[k] = window[k];
+      reader.read(taps + size, n);
+      for (int i = 0; i < n; ++i) f(taps + i);
+      for (int k = 0; k < size; ++k) window[k] = taps[n + k];
+      steps -= n;
+    }
+  }
+
+private:
+  static constexpr int size = Interp::taps - 1;
+  static constexpr int chunk_steps = 32;
+  int16_t window[size > 0 ? size : 1];
+};
+
+template<int sample_rate, template<int> class Kernel = LinearKernel>
 class SampleSource : public SampleSourceBase {
 public:
   SampleSource() { }
-  virtual void supply(sample_t* buffer, int count);
+  virtual void supply(sample_t* buffer, int count, ScratchPool&);
+
+private:
+  static constexpr int factor = upsampleFactor<sample_rate>();
+  using Interp = Interpolator<factor, Kernel>;
+  SampleWindow<Interp> window;
 };
 
+template<int sample_rate, template<int> class Kernel>
+void SampleSource<sample_rate, Kernel>::supply(
+  sample_t* buffer, int count, ScratchPool&)
+{
+  if (restart) {
+    reader.start(samples, nextSample, false);
+    window.begin(reader);
+    restart = false;
+  }
+
+  const int steps = min(count / factor, max(samples.length() - nextSample, 0));
+  const comp_t a = amp / Interp::scale;
+  auto step = [&](const int16_t* taps) {
+    Interp::template step<StoreSamples>(buffer, taps, a, sampleTapToComp);
+  };
+  window.run(reader, steps, step);
+  nextSample += steps;
+
+  StoreSamples::silence(buffer, count - steps * factor);
+}
+
+
+
+class SampleStream {
+  // Samples read ahead from a file, a block at a time, into a small ring,
+  // so that samples far larger than the internal flash can be played.
+  //
+  // All the reading from the file is done by start() and fill(), called
+  // from loop(). The DMA interrupt, through a StreamSource, only takes
+  // samples from blocks already read, and never waits on the file.
+  //
+  // If the ring runs dry while playing, that's an underrun: the last sample
+  // is held until the next block arrives, and the underrun is counted.
+  //
+  // A stream can also start with a head: the first part of the file, kept
+  // in internal flash. It plays at once, while loop() opens the file and
+  // reads the tail, the rest of the file, which is spliced on after it. If
+  // the tail isn't there when the head runs out, it is late, and counted.
+  //
+  // The File can be an SdFat FatFile, or anything with the same read() and
+  // seekSet().
+public:
+  static constexpr int block_bytes = 512;
+    // a whole flash sector, and a whole number of blocks of every format
+  static constexpr int slots = 4;
+
+  SampleStream();
+
+  // from loop()
+
+  template<typename File> void start(File& f, Samples::Format format);
+    // rewinds f, reads the ring full, and plays from the start
+  void start(const Samples& head, bool tail);
+    // plays head at once; if there's a tail, it comes from fill() after,
+    // with a file positioned just past the head
+    // NB: The head must be a whole number of blocks long.
+  template<typename File> void fill(File& f);
+    // reads into any free slots
+  void end() { atEnd = true; }
+    // there's no more: play what's been read, and stop
+  void stop();
+
+  unsigned long underruns() const     { return underrunCount; }
+  unsigned long samplesMissed() const { return missedCount; }
+  int lowWater() const                { return lowestReady; }
+    // fewest blocks that were waiting, as the interrupt took the next one,
+    // before the end of the file
+  unsigned long tailsLate() const     { return lateCount; }
+  unsigned long tailsPlayed() const   { return tailCount; }
+  void resetStats();
+
+  // from the interrupt
+
+  bool playing() const
+    { return active && !(atEnd && taken == filled && !left && !headLeft); }
+  uint8_t generation() const { return startCount; }
+    // changes with every start()
+
+  void read(int16_t* out, int count);
+    // as SampleReader::read(), but never wraps
+
+private:
+  struct Slot {
+    uint8_t data[block_bytes];
+    int bytes;
+  };
+  Slot ring[slots];
+
+  Samples::Format format;
+  volatile bool active;
+  volatile bool atEnd;              // the last block has been read
+  volatile uint8_t startCount;
+
+  // NB: Each count is only written by one side: filled by loop(), taken
+  //     by the interrupt. Slots between them are the interrupt's to read.
+  volatile unsigned filled;
+  volatile unsigned taken;
+
+  SampleReader reader;              // within the head, or the slot being taken
+  int headLeft;                     // samples left in the head
+  int left;                         // samples left in the slot
+  int16_t last;
+  bool starved;
+
+  unsigned long underrunCount;
+  unsigned long missedCount;
+  int lowestReady;
+  unsigned long lateCount;
+  unsigned long tailCount;
+
+  void reset(Samples::Format format);
+  void go();
+  void released();
+};
+
+template<typename File>
+void SampleStream::start(File& f, Samples::Format fmt) {
+  reset(fmt);
+  f.seekSet(0);
+  fill(f);
+  go();
+}
+
+template<typename File>
+void SampleStream::fill(File& f) {
+  while (!atEnd && filled - taken < unsigned(slots)) {
+    Slot& s = ring[filled % slots];
+    int r = f.read(s.data, block_bytes);
+    if (r < block_bytes) atEnd = true;
+    if (r <= 0) break;
+    s.bytes = r;
+
+    released();
+    filled = filled + 1;
+  }
+}
+
+
+template<int sample_rate, template<int> class Kernel = LinearKernel>
+class StreamSource : public SoundSource {
+  // Plays a SampleStream, once through, from each start().
+public:
+  StreamSource(SampleStream& s) : stream(s), seen(0), amp(0) { }
+  void setAmp(float a) { amp = a; }
+
+  virtual void supply(sample_t* buffer, int count, ScratchPool&)
+    { render<StoreSamples>(buffer, count); }
+  virtual void supplyAdd(sample_t* buffer, int count, ScratchPool&)
+    { render<AddSamples>(buffer, count); }
+  virtual int scratchDepthAdd() const { return 0; }
+
+private:
+  SampleStream& stream;
+  uint8_t seen;       // the stream's generation the window was begun on
+
+  using comp_t = SFixed<15, 16>;
+  comp_t amp;
+
+  static constexpr int factor = upsampleFactor<sample_rate>();
+  using Interp = Interpolator<factor, Kernel>;
+  SampleWindow<Interp> window;
+
+  template<typename Out> void render(sample_t* buffer, int count);
+};
+
+template<int sample_rate, template<int> class Kernel>
+template<typename Out>
+void StreamSource<sample_rate, Kernel>::render(sample_t* buffer, int count) {
+  if (!stream.playing()) {
+    Out::silence(buffer, count);
+    return;
+  }
+
+  if (seen != stream.generation()) {
+    window.begin(stream);
+    seen = stream.generation();
+  }
+
+  const int steps = count / factor;
+  const comp_t a = amp / Interp::scale;
+  auto step = [&](const int16_t* taps) {
+    Interp::template step<Out>(buffer, taps, a, sampleTapToComp);
+  };
+  window.run(stream, steps, step);
+
+  Out::silence(buffer, count - steps * factor);
+}
 
 
 class SampleGateSourceBase : public SoundSource {
 public:
   SampleGateSourceBase();
   void load(const Samples& s);
+    // with SampleHeader::defaults() for this voice's rate
+  void load(const Samples& s, const SampleHeader& h,
+    const SampleCues* c = nullptr);
+    // c, if given, must be built for the same samples and header; without
+    // cues, setPosition() starts at a block and loops have a seam
+
+  // NB: load() is called from loop(), while the DMA interrupt is playing
+  //     the voice. It writes a bank not in use, and the interrupt takes it
+  //     up at the start of a block, fading the old one out over that block
+  //     first. A second load() waits for the first to be taken up, which
+  //     is at most a block.
+  void settle();
+    // waits until the interrupt has taken up the last load(), or takes it
+    // up itself if the interrupt hasn't within settle_ms
+  void idle() { if (live != playing) adopt(); }
+    // for the interrupt to call in place of supply(), when not sounding
 
   void gate(float a);
   void gateOff();
+  void retrigger(float a);    // restart from the top, even if still sounding
 
   void setPosition(float);
 
+  using amp_t = UFixed<0, 32>;
+
+  bool  sounding() const;
+  amp_t level() const { return amp.value(); }
+
 protected:
   virtual int sampleRate() const = 0;
+  virtual void loaded(const SampleHeader& h) { }
+    // for voices that need more from the header; called by the interrupt
+
+  using comp_t = SFixed<15, 16>;
+
+  // NB: Everything from the header is worked out at load, so supply() only
+  //     ever reads it.
+  struct Bank {
+    Samples samples;
+    SampleHeader header;
+    bool looped;
+    int loopStart;
+    int loopEnd;
+    comp_t gain;
+    int startSample;
+    const SampleCues* cues;
+  };
+  Bank banks[2];
+  volatile int live;        // the bank load() wrote last
+  volatile int playing;     // the bank the fields below were taken from
 
   Samples samples;
+  SampleReader reader;
   bool looped;
+  int loopStart;
+  int loopEnd;
+  comp_t gain;
   int startSample;
+  volatile float position;    // as last given to setPosition()
+  const SampleCues* cues;
+  volatile int startCue;      // in cues->starts, or -1 for startSample
   int nextSample;
+  volatile bool restart;
 
-  using amp_t = UFixed<0, 32>;
+  void adopt();
+  bool fadeForSwap(int steps) {
+    // At the start of a block: if a new bank is waiting, and the old one
+    // can be heard, ramps amp down over the block, and returns true. The
+    // block should then step amp by ramp(), not slew(), and end with
+    // swapped().
+    if (live == playing) return false;
+    if (amp.value() == amp_t(0)) {
+      adopt();
+      return false;
+    }
+    fadeGoal = amp.goal();
+    amp.rampTo(amp_t(0), steps);
+    return true;
+  }
+  void swapped() {
+    // in from silence, as if gated again
+    amp.rampDone();
+    adopt();
+    amp.set(fadeGoal);
+  }
+
+  SampleReader::Mark startMark() const {
+    const int c = startCue;
+    const SampleCues* const k = cues;
+    if (c >= 0 && k) return k->starts[c];
+    // NB: setPosition() may have been working from the last bank.
+    SampleReader::Mark m;
+    m.next = samples.blockStart(min(startSample, samples.length()));
+    return m;
+  }
+  void startReader() {
+    const SampleReader::Mark m = startMark();
+    nextSample = m.next;
+    if (looped) reader.start(samples, m, loopStart, loopEnd, cues);
+    else        reader.start(samples, m, 0, 0, nullptr);
+  }
+  void wrap() {
+    if (!looped) return;
+    const int to =
+      cues && cues->spliceLength ? cues->resume.next : loopStart;
+    while (nextSample >= loopEnd) nextSample -= loopEnd - to;
+  }
 
-  amp_t amp;
-  amp_t ampTarget;
+  Smoother<amp_t> amp;
+  amp_t fadeGoal;
 };
 
-template<int sample_rate>
+template<int sample_rate, template<int> class Kernel = LinearKernel>
 class SampleGateSource : public SampleGateSourceBase {
 public:
   SampleGateSource() { }
-  virtual void supply(sample_t* buffer, int count);
+
+  virtual void supply(sample_t* buffer, int count, ScratchPool&)
+    { render<StoreSamples>(buffer, count); }
+  virtual void supplyAdd(sample_t* buffer, int count, ScratchPool&)
+    { render<AddSamples>(buffer, count); }
+  virtual int scratchDepthAdd() const { return 0; }
+
+protected:
+  virtual int sampleRate() const { return sample_rate; }
+
+  static constexpr int factor = upsampleFactor<sample_rate>();
+
+  using Interp = Interpolator<factor, Kernel>;
+  SampleWindow<Interp> window;
+
+  template<typename Out> void render(sample_t* buffer, int count);
+};
+
+template<int sample_rate, template<int> class Kernel>
+template<typename Out>
+void SampleGateSource<sample_rate, Kernel>::render(sample_t* buffer, int count) {
+  const bool fading = fadeForSwap(count / factor);
+  const int length = samples.length();
+  if (length == 0) {
+    Out::silence(buffer, count);
+    if (fading) swapped();
+    return;
+  }
+
+  if (restart) {
+    startReader();
+    window.begin(reader);
+    restart = false;
+  }
+
+  int steps = count / factor;
+  if (!looped) steps = min(steps, max(length - nextSample, 0));
+
+  const comp_t level = gain / Interp::scale;
+  auto step = [&](const int16_t* taps) {
+    const comp_t a = comp_t(amp.value()) * level;
+
+    Interp::template step<Out>(buffer, taps, a, sampleTapToComp);
+
+    // NB: amp steps once per sample read, so at the sample's rate
+    constexpr amp_t slewUp(slewFactor(0.0012, -20, sample_rate));
+    constexpr amp_t slewDown(slewFactor(0.085, -20, sample_rate));
+    if (fading) amp.ramp();
+    else        amp.slew(slewUp, slewDown);
+  };
+  window.run(reader, steps, step);
+
+  nextSample += steps;
+  wrap();
+
+  Out::silence(buffer, count - steps * factor);
+  if (fading) swapped();
+}
+
+
+template<typename Interp = FracLinear>
+class VarRateGateSource : public SampleGateSourceBase {
+  // A gate voice that plays its samples at any rate, not just one that
+  // divides SAMPLE_RATE, and at any pitch: it steps through the samples by
+  // a fractional amount for each output sample, and Interp reads between
+  // them. Interp is FracLinear or FracCubic.
+public:
+  VarRateGateSource() : fileRate(int(SAMPLE_RATE) / 2), pitch(1.0f), frac(0)
+    { updateStep(); }
+
+  void setRate(int rate)        { fileRate = rate; updateStep(); }
+    // of the samples, in Hz; load() sets it from the header
+  void setPitch(float ratio)    { pitch = ratio; updateStep(); }
+    // 1.0 plays at the samples' own rate, 2.0 an octave up
+
+  virtual void supply(sample_t* buffer, int count, ScratchPool&)
+    { render<StoreSamples>(buffer, count); }
+  virtual void supplyAdd(sample_t* buffer, int count, ScratchPool&)
+    { render<AddSamples>(buffer, count); }
+  virtual int scratchDepthAdd() const { return 0; }
+
+  static constexpr int frac_bits = 24;
+  static constexpr float max_step = 4.0f;
+    // samples read per output sample, at most: with frac_bits, it keeps
+    // the position within a chunk in 32 bits
+
+  uint32_t step() const { return stepNow; }
+    // samples read per output sample, with frac_bits
+
+protected:
+  virtual int sampleRate() const { return fileRate; }
+  virtual void loaded(const SampleHeader& h) { setRate(h.rate); }
+
+private:
+  int fileRate;
+  float pitch;
+  volatile uint32_t stepNow;
+
+  void updateStep() {
+    float s = float(fileRate) / SAMPLE_RATE * pitch;
+    s = s < max_step ? s : max_step - 1.0f / (1 << 16);
+    stepNow = uint32_t(s * float(1 << frac_bits) + 0.5f);
+  }
+
+  static constexpr int chunk = 32;      // output samples at a time
+  static constexpr int taps = Interp::taps;
+
+  uint32_t frac;          // position past window[before], with frac_bits
+  int16_t window[taps];   // from before the next sample to be read
+
+  template<typename Out> void render(sample_t* buffer, int count);
+};
+
+template<typename Interp>
+template<typename Out>
+void VarRateGateSource<Interp>::render(sample_t* buffer, int count) {
+  const bool fading = fadeForSwap(count);
+  const int length = samples.length();
+  if (length == 0) {
+    Out::silence(buffer, count);
+    if (fading) swapped();
+    return;
+  }
+
+  if (restart) {
+    startReader();
+    int16_t w[taps];
+    reader.read(w + Interp::before, taps - Interp::before);
+    for (int k = 0; k < Interp::before; ++k) w[k] = w[Interp::before];
+    for (int k = 0; k < taps; ++k) window[k] = w[k];
+    frac = 0;
+    restart = false;
+  }
+
+  const uint32_t inc = stepNow;
+  constexpr uint32_t one = uint32_t(1) << frac_bits;
+  // NB: y has 13 fraction bits, and gain is cut to 12, so the product fits
+  //     in 32 bits for any gain a header can give.
+  const int32_t yGain = gain.getInternal() >> (comp_t::FractionSize - 12);
+  constexpr int yShift = 13 + 12 - comp_t::FractionSize;
+  constexpr amp_t slewUp(slewFactor(0.0012, -20, SAMPLE_RATE));
+  constexpr amp_t slewDown(slewFactor(0.085, -20, SAMPLE_RATE));
+
+  int done = 0;
+  while (done < count) {
+    int n = min(count - done, chunk);
+    if (!looped) {
+      // only as far as the last sample
+      const int left = length - nextSample;
+      if (left <= 0) break;
+      if (left < chunk * int(max_step) + 1) {
+        const uint32_t room = uint32_t(left) * one - frac;
+        n = min(n, int((room + inc - 1) / inc));
+      }
+    }
+
+    const int advance = int((frac + n * inc) >> frac_bits);
+    int16_t tap[taps + chunk * int(max_step)];
+    for (int k = 0; k < taps; ++k) tap[k] = window[k];
+    reader.read(tap + taps, advance);
+
+    uint32_t pos = frac;
+    for (int i = 0; i < n; ++i, pos += inc) {
+      const int32_t y = Interp::at(tap + (pos >> frac_bits),
+        (pos >> (frac_bits - 16)) & 0xffff);
+      Out::put(buffer, sample_t(
+        comp_t::fromInternal(y * yGain >> yShift) * comp_t(amp.value())));
+      if (fading) amp.ramp();
+      else        amp.slew(slewUp, slewDown);
+    }
+
+    for (int k = 0; k < taps; ++k) window[k] = tap[advance + k];
+    frac = pos - uint32_t(advance) * one;
+    nextSample += advance;
+    wrap();
+    done += n;
+  }
+
+  Out::silence(buffer, count - done);
+  if (fading) swapped();
+}
+
+
+class GranularSourceBase : public SampleGateSourceBase {
+  // A gate voice that plays its samples as a cloud of short, overlapping
+  // grains, each from somewhere around the position setPosition() picks.
+  // Held still, the sound freezes there; with a speed, the position drifts
+  // on, and the sound is stretched in time.
+  //
+  // Grains are started at even intervals, so that max_grains overlap; a
+  // grain that can't start, because all are still playing, is dropped. So
+  // no block ever renders more than max_grains.
+public:
+  GranularSourceBase();
+
+  void setSpeed(float s) { speed = s; }
+    // 0 freezes, 1 moves through the samples at their own rate
+
+  static constexpr int max_grains = 2;
+    // NB: Each grain reads and decodes as a gate voice does, so costs about
+    //     as much; pbox-bench compares them.
+  static constexpr int grain_ms = 60;
+  static constexpr int spread_ms = 20;    // a grain starts this far either side
+
+  unsigned long grainsStarted() const { return started; }
+  unsigned long grainsDropped() const { return dropped; }
+
+protected:
+  virtual void loaded(const SampleHeader& h);
+
+  void startGrains();
+  void renderGrains(int32_t* mix, int count);
+    // adds count samples of all the grains to mix, in 16 bit units, at the
+    // samples' rate
+
+  static constexpr int chunk = 32;      // samples at a time
+
+private:
+  struct Grain {
+    SampleReader reader;
+    int left;           // samples still to play, 0 if not playing
+    uint32_t phase;     // in the window, with 16 fraction bits
+  };
+  Grain grains[max_grains];
+
+  int grainLength;
+  int interval;         // between grain starts
+  int spread;
+  uint32_t windowStep;  // per sample
+  int untilNext;        // samples until the next grain starts
+  float drift;          // from position, in samples
+  volatile float speed;
+  uint32_t noise;
+
+  volatile unsigned long started;
+  volatile unsigned long dropped;
+
+  void startGrain();
+};
+
+template<int sample_rate>
+class GranularSource : public GranularSourceBase {
+public:
+  GranularSource() : last(0) { }
+
+  virtual void supply(sample_t* buffer, int count, ScratchPool&)
+    { render<StoreSamples>(buffer, count); }
+  virtual void supplyAdd(sample_t* buffer, int count, ScratchPool&)
+    { render<AddSamples>(buffer, count); }
+  virtual int scratchDepthAdd() const { return 0; }
+
 protected:
   virtual int sampleRate() const { return sample_rate; }
+
+private:
+  static constexpr int factor = upsampleFactor<sample_rate>();
+  using Interp = Interpolator<factor, LinearKernel>;
+
+  int32_t last;         // the last sample mixed, for interpolating from
+
+  template<typename Out> void render(sample_t* buffer, int count);
+};
+
+template<int sample_rate>
+template<typename Out>
+void GranularSource<sample_rate>::render(sample_t* buffer, int count) {
+  const bool fading = fadeForSwap(count / factor);
+  if (samples.length() == 0) {
+    Out::silence(buffer, count);
+    if (fading) swapped();
+    return;
+  }
+
+  if (restart) {
+    startGrains();
+    last = 0;
+    restart = false;
+  }
+
+  // NB: The grains' windows overlap to sum to max_grains / 2, so that is
+  //     taken out here.
+  static_assert(max_grains % 2 == 0, "grain windows must overlap evenly");
+  const comp_t level = gain / (max_grains / 2 * Interp::scale);
+  const int steps = count / factor;
+
+  for (int done = 0; done < steps; ) {
+    const int n = min(steps - done, int(chunk));
+    int32_t mix[chunk + 1];
+    mix[0] = last;
+    for (int i = 1; i <= n; ++i) mix[i] = 0;
+    renderGrains(mix + 1, n);
+
+    for (int i = 0; i < n; ++i) {
+      const comp_t a = comp_t(amp.value()) * level;
+      Interp::template step<Out>(buffer, mix + i, a, sampleTapToComp);
+
+      constexpr amp_t slewUp(slewFactor(0.0012, -20, sample_rate));
+      constexpr amp_t slewDown(slewFactor(0.085, -20, sample_rate));
+      if (fading) amp.ramp();
+      else        amp.slew(slewUp, slewDown);
+    }
+    last = mix[n];
+    done += n;
+  }
+
+  Out::silence(buffer, count - steps * factor);
+  if (fading) swapped();
+}
+
+
+// What the sketch's chain costs on the SAMD21, in cycles per engine sample,
+// so that the gate voices are budgeted against what the rest leaves.
+// NB: Not measured on the device, which has no cycle counter: each is
+//     pbox-bench's host cycles/sample for the node, with ENGINE_DIVISOR at
+//     1, times m0_cycles_per_host_cycle. The load in DmaDac's report is
+//     what to check them against on the device, and to correct them by.
+constexpr int m0_cycles_per_host_cycle = 8;
+  // the M0+ takes a cycle an instruction, two a load, and has no 32x32 to
+  // 64 bit multiply; the host retires three or four instructions a cycle
+constexpr int gate_voice_cycles_per_sample = 106;   // bench: 13.2 a voice
+constexpr int mix_cycles_per_sample = 47;           // bench: 5.8
+constexpr int filter_cycles_per_sample = 227;       // bench: 28.3
+constexpr int delay_cycles_per_sample = 121;        // bench: 15.1
+constexpr int stream_cycles_per_sample = 34;        // bench: 4.2 streaming
+constexpr int chain_cycles_per_sample =
+  2 * mix_cycles_per_sample + filter_cycles_per_sample
+  + delay_cycles_per_sample + stream_cycles_per_sample;
+  // pbox.ino's chain, but for the gate voices: two mixes, as the backing
+  // track is mixed in after the pads
+constexpr int render_cycles_per_sample =
+  SAMPLE_RATE_CPU_DIVISOR * ENGINE_DIVISOR * 15 / 16;
+  // the rest of each sample period is for the interrupts, and loop()
+constexpr int max_gate_voices =
+  (render_cycles_per_sample - chain_cycles_per_sample)
+    / gate_voice_cycles_per_sample;
+
+template<int sample_rate, int voice_count,
+  template<int> class Kernel = LinearKernel>
+class SampleGateVoices : public SoundSource {
+  // A pool of gate voices playing the same sample, so that a new hit doesn't
+  // cut off the tail of the last. When all are sounding, the quietest is
+  // stolen. At most voice_count voices are rendered in any block.
+
+  static_assert(voice_count <= max_gate_voices,
+    "too many gate voices to render in a DMA buffer period");
+
+public:
+  SampleGateVoices() : cuesLive(0), held(-1), rendered(0) { }
+
+  void load(const Samples& s) {
+    load(s, SampleHeader::defaults(s.format(), sample_rate, s.length()));
+  }
+
+  void load(const Samples& s, const SampleHeader& h) {
+    // NB: Once every voice has taken up the last load, none is using the
+    //     other cues, so they can be built while the voices play on.
+    for (auto& v : voices) v.settle();
+    SampleCues& c = cues[1 - cuesLive];
+    c.build(s, h);
+    for (auto& v : voices) v.load(s, h, &c);
+    cuesLive = 1 - cuesLive;
+    held = -1;
+  }
+  void settle() { for (auto& v : voices) v.settle(); }
+  void idle() { for (auto& v : voices) v.idle(); }
+
+  void gate(float a) {
+    if (held < 0) {
+      held = pickVoice();
+      voices[held].retrigger(a);
+    }
+    else
+      voices[held].gate(a);
+  }
+
+  void gateOff() {
+    if (held >= 0) voices[held].gateOff();
+    held = -1;
+  }
+
+  void setPosition(float p) { for (auto& v : voices) v.setPosition(p); }
+
+  virtual void supply(sample_t* buffer, int count, ScratchPool& scratch) {
+    render(buffer, count, scratch, false);
+  }
+  virtual void supplyAdd(sample_t* buffer, int count, ScratchPool& scratch) {
+    render(buffer, count, scratch, true);
+  }
+  virtual int scratchDepthAdd() const { return 0; }
+
+  unsigned long voicesRendered() const { return rendered; }
+    // total, over all calls to supply()
+
+  const SampleCues* sampleCues() const { return &cues[cuesLive]; }
+    // as built by the last load()
+
+private:
+  SampleGateSource<sample_rate, Kernel> voices[voice_count];
+  SampleCues cues[2];
+  int cuesLive;
+  int held;   // the voice gated on now, or -1
+  unsigned long rendered;
+
+  int pickVoice() const {
+    int quietest = 0;
+    for (int i = 0; i < voice_count; ++i) {
+      if (!voices[i].sounding()) return i;
+      if (voices[i].level() < voices[quietest].level()) quietest = i;
+    }
+    return quietest;
+  }
+
+  void render(sample_t* buffer, int count, ScratchPool& scratch, bool adding) {
+    for (auto& v : voices) {
+      if (!v.sounding()) {
+        v.idle();
+        if (!v.sounding()) continue;
+      }
+      if (adding) v.supplyAdd(buffer, count, scratch);
+      else        v.supply(buffer, count, scratch);
+      adding = true;
+      rendered += 1;
+    }
+    if (!adding) StoreSamples::silence(buffer, count);
+  }
+};
+
+
+template<int sample_rate, int voice_count>
+class SamplePad : public SoundSource {
+  // What a touch pad plays: its sample, either gated, by a pool of gate
+  // voices, or granular. Only one is rendered, so the pad costs no more
+  // than its gate voices.
+
+  static_assert(GranularSourceBase::max_grains <= voice_count,
+    "granular voice costs more than the pad's gate voices");
+
+public:
+  SamplePad() : isGranular(false) { }
+
+  void load(const Samples& s) {
+    load(s, SampleHeader::defaults(s.format(), sample_rate, s.length()));
+  }
+  void load(const Samples& s, const SampleHeader& h) {
+    // NB: grains shares the gates' cues, so must let go of the old ones
+    //     before gates builds the new.
+    grains.settle();
+    gates.load(s, h);
+    grains.load(s, h, gates.sampleCues());
+  }
+
+  void setGranular(bool g) {
+    // NB: What the other was playing is cut off.
+    if (g == isGranular) return;
+    if (g)  gates.gateOff();
+    else    grains.gateOff();
+    isGranular = g;
+  }
+  bool granular() const { return isGranular; }
+
+  void gate(float a) {
+    if (isGranular) grains.gate(a);
+    else            gates.gate(a);
+  }
+  void gateOff() {
+    if (isGranular) grains.gateOff();
+    else            gates.gateOff();
+  }
+  void setPosition(float p) {
+    gates.setPosition(p);
+    grains.setPosition(p);
+  }
+  void setSpeed(float s) { grains.setSpeed(s); }
+
+  virtual void supply(sample_t* buffer, int count, ScratchPool& scratch) {
+    if (isGranular) { grains.supply(buffer, count, scratch); gates.idle(); }
+    else            { gates.supply(buffer, count, scratch); grains.idle(); }
+  }
+  virtual void supplyAdd(sample_t* buffer, int count, ScratchPool& scratch) {
+    if (isGranular) { grains.supplyAdd(buffer, count, scratch); gates.idle(); }
+    else            { gates.supplyAdd(buffer, count, scratch); grains.idle(); }
+  }
+  virtual int scratchDepthAdd() const { return 0; }
+
+  unsigned long voicesRendered() const { return gates.voicesRendered(); }
+  unsigned long grainsStarted() const { return grains.grainsStarted(); }
+  unsigned long grainsDropped() const { return grains.grainsDropped(); }
+
+private:
+  SampleGateVoices<sample_rate, voice_count> gates;
+  GranularSource<sample_rate> grains;
+  volatile bool isGranular;
 };
 
 
@@ -115,7 +1118,8 @@ class MixSource : public SoundSource {
 public:
   MixSource(SoundSource& s1, SoundSource& s2);
 
-  virtual void supply(sample_t* buffer, int count);
+  virtual void supply(sample_t* buffer, int count, ScratchPool&);
+  virtual int scratchDepth() const;
 
 private:
   SoundSource& s1;
@@ -124,31 +1128,124 @@ private:
 
 
 class FilterSource : public SoundSource {
+  // A state variable filter, in the trapezoidal ("zero delay feedback")
+  // form, which stays stable however fast the frequency is swept.
 public:
   FilterSource(SoundSource& in);
-  void setFreqAndQ(float freq, float q);
+  void setFreqAndQ(float freq, float q);    // q in range 0.0 to 0.9
 
-  virtual void supply(sample_t* buffer, int count);
+  enum Mode { lowPass, bandPass, highPass };
+  void setMode(Mode m) { mode = m; }
+
+  virtual void supply(sample_t* buffer, int count, ScratchPool&);
+  virtual int scratchDepth() const { return in.scratchDepth(); }
+
+  static constexpr float freqMax = SAMPLE_RATE / 6.0f;
+
+  class Block;
 
 private:
   SoundSource& in;
 
-  sample_t f;
-  sample_t fb;
+  using coef_t = UFixed<0, 16>;
+  struct Coefficients {
+    coef_t g;       // tan(pi * freq / SAMPLE_RATE)
+    coef_t kHalf;   // damping, 1/Q, halved so it fits
+    coef_t d;       // 1 / (1 + k*g + g*g)
+  };
+
+  // NB: setFreqAndQ() is called from loop(), while the DMA interrupt reads
+  //     the coefficients. It writes the set not live, then flips live, so
+  //     the interrupt always takes a whole set.
+  Coefficients pending[2];
+  volatile int live;
+  volatile Mode mode;
+
+  // coefficients as of the end of the last block, ramped to the live set
+  // over each block
+  Smoother<coef_t> g;
+  Smoother<coef_t> kHalf;
+  Smoother<coef_t> d;
+
+  static constexpr int stateShift = 11;   // state has 24 fraction bits
+  int32_t s1;
+  int32_t s2;
+};
+
+class FilterSource::Block {
+  // The filter's state, held in locals while processing one block
+public:
+  Block(FilterSource& n, int count)
+    : node(n), mode(n.mode), g(n.g), kHalf(n.kHalf), d(n.d),
+      s1(n.s1), s2(n.s2)
+  {
+    const Coefficients& c = n.pending[n.live];
+    g.rampTo(c.g, count);
+    kHalf.rampTo(c.kHalf, count);
+    d.rampTo(c.d, count);
+    ramping = g.ramping() || kHalf.ramping() || d.ramping();
+  }
+  void done() {
+    g.rampDone();
+    kHalf.rampDone();
+    d.rampDone();
+    node.g = g;
+    node.kHalf = kHalf;
+    node.d = d;
+    node.s1 = s1;
+    node.s2 = s2;
+  }
+
+  inline sample_t step(sample_t s_in) {
+    const int32_t gi = g.value().getInternal();
+    const int32_t x = int32_t(s_in.getInternal()) * (1 << stateShift);
+
+    int32_t hp = mul(x - 2 * mul(s1, kHalf.value().getInternal())
+                       - mul(s1, gi) - s2,
+                     d.value().getInternal());
+    int32_t gh = mul(hp, gi);
+    int32_t bp = gh + s1;
+    s1 = gh + bp;
+    int32_t gb = mul(bp, gi);
+    int32_t lp = gb + s2;
+    s2 = gb + lp;
+
+    if (ramping) {
+      g.ramp();
+      kHalf.ramp();
+      d.ramp();
+    }
 
-  sample_t b0;
-  sample_t b1;
+    int32_t out = mode == lowPass ? lp : mode == bandPass ? bp : hp;
+    return sample_t::fromInternal(clamp(out >> stateShift, int32_t(-32768), int32_t(32767)));
+  }
+
+private:
+  static inline int32_t mul(int32_t s, int32_t c) {
+    // s * c / 2^16, for c a coef_t, with only 32 bit multiplies
+    return (s >> 16) * c + int32_t((uint32_t(s) & 0xffff) * uint32_t(c) >> 16);
+  }
+
+  FilterSource& node;
+  const Mode mode;
+
+  Smoother<coef_t> g;
+  Smoother<coef_t> kHalf;
+  Smoother<coef_t> d;
+  bool ramping;
+
+  int32_t s1;
+  int32_t s2;
 };
 
 
-class DelaySource : public SoundSource {
+class DelaySourceBase : public SoundSource {
 public:
-  DelaySource(SoundSource& in);
+  DelaySourceBase(SoundSource& in);
   void setDelayMod(float);    // 1.0 is base delay length
   void setFeedback(float);    // in range 0.0 to 1.0 (careful!)
 
-
-  virtual void supply(sample_t* buffer, int count);
+  virtual int scratchDepth() const { return in.scratchDepth(); }
 
   static constexpr float maxDelay = 0.150;
   static constexpr float baseDelay = 0.080;
@@ -156,22 +1253,227 @@ public:
   static constexpr float maxMod = maxDelay / baseDelay;
   static constexpr float minMod = minDelay / baseDelay;
 
-private:
+protected:
   SoundSource& in;
 
   using delay_t = SFixed<15,16>;
-  delay_t delay;
-  delay_t delayTarget;
+  Smoother<delay_t> delay;
+  Smoother<sample_t> feedback;
 
-  sample_t feedback;
-  sample_t feedbackTarget;
+  static const SlewRate<delay_t> delaySlew;
+  static const SlewRate<sample_t> feedbackSlew;
 
   static constexpr int maxDelaySamples = maxDelay * SAMPLE_RATE;
   static constexpr int baseDelaySamples = baseDelay * SAMPLE_RATE;
 
   static_assert(maxDelaySamples < 1 << delay_t::IntegerSize,
     "delay_t integer portion isn't big enough");
+};
+
+template<template<int> class Tank = FullTank>
+class DelaySource : public DelaySourceBase {
+  // The tank storage is chosen by Tank, see delaytank.h
+public:
+  DelaySource(SoundSource& in) : DelaySourceBase(in) { }
+
+  virtual void supply(sample_t* buffer, int count, ScratchPool& scratch) {
+    in.supply(buffer, count, scratch);
+
+    Block b(*this, count);
+    for (; count--; ++buffer)
+      *buffer = b.step(*buffer);
+    b.done();
+  }
+
+  class Block;
+
+private:
+  using tank_t = Tank<maxDelaySamples>;
+  tank_t tank;
+};
+
+template<template<int> class Tank>
+class DelaySource<Tank>::Block {
+  // The delay's state, held in locals while processing one block
+public:
+  Block(DelaySource& n, int count)
+    : node(n), tank(n.tank), head(n.tank.head),
+      delay(n.delay), feedback(n.feedback)
+  {
+    delay.rampOver(delaySlew, count);
+    feedback.rampOver(feedbackSlew, count);
+  }
+  void done() {
+    delay.rampDone();
+    feedback.rampDone();
+    node.delay = delay;
+    node.feedback = feedback;
+    node.tank.head = head;
+  }
+
+  inline sample_t step(sample_t in) {
+    sample_t v = sample_t::fromInternal(
+      tank.read(head, delay.value().getInternal()));
+
+    constexpr sample_t two(2.0);
+    constexpr sample_t negtwo(-2.0);
+    sample_t w = in + feedback.value() * v;
+    w = clamp(w, negtwo, two);
+
+    tank.write(head, w.getInternal());
+
+    delay.ramp();
+    feedback.ramp();
+
+    return w;
+  }
+
+private:
+  DelaySource& node;
+  tank_t& tank;
+  typename tank_t::Head head;
+
+  Smoother<delay_t> delay;
+  Smoother<sample_t> feedback;
+};
+
+
+template<typename... Stages> struct StageList;
+
+template<>
+struct StageList<> {
+  StageList() { }
+
+  struct Block {
+    Block(StageList&, int) { }
+    void done() { }
+    inline sample_t step(sample_t s) { return s; }
+  };
+};
+
+template<typename Stage, typename... Rest>
+struct StageList<Stage, Rest...> {
+  StageList(Stage& s, Rest&... r) : stage(s), rest(r...) { }
+
+  Stage& stage;
+  StageList<Rest...> rest;
+
+  struct Block {
+    Block(StageList& l, int count)
+      : stage(l.stage, count), rest(l.rest, count) { }
+    void done() { stage.done(); rest.done(); }
+    inline sample_t step(sample_t s) { return rest.step(stage.step(s)); }
+
+    typename Stage::Block stage;
+    typename StageList<Rest...>::Block rest;
+  };
+};
+
+
+template<int block_count, typename Source, typename... Stages>
+class Chain : public SoundSource {
+  // A chain with every stage after the source fused into one per-sample
+  // loop, over a block size fixed at compile time. The stages are the same
+  // nodes as used on their own (each must have a Block), but the Chain pulls
+  // from the source itself, and the stages' own inputs are not used.
+public:
+  Chain(Source& s, Stages&... st) : source(s), stages(st...) { }
+
+  virtual void supply(sample_t* buffer, int count, ScratchPool& scratch) {
+    source.supply(buffer, count, scratch);
+
+    typename StageList<Stages...>::Block b(stages, count);
+    for (; count >= block_count; count -= block_count)
+      for (int i = 0; i < block_count; ++i, ++buffer)
+        *buffer = b.step(*buffer);
+    for (; count > 0; --count, ++buffer)
+      *buffer = b.step(*buffer);
+    b.done();
+  }
+
+  virtual int supplyDac(sample_t* buffer, int count, ScratchPool& scratch,
+    int dac_bits = DAC_BITS)
+  {
+    source.supply(buffer, count, scratch);
+    return Swar::withDac(dac_bits, [&](auto dac) {
+      return convertStages<decltype(dac)>(buffer, count);
+    });
+  }
+
+  virtual int scratchDepth() const { return source.scratchDepth(); }
+
+private:
+  Source& source;
+  StageList<Stages...> stages;
+
+  template<typename Dac>
+  int convertStages(sample_t* buffer, int count) {
+    // As supply() runs the stages, with the conversion in the same loop:
+    // each pair of samples out of the stages is packed, and converted as
+    // one word.
+    static_assert(block_count % 2 == 0, "blocks are converted in pairs");
+
+    typename StageList<Stages...>::Block b(stages, count);
+    int clipped = 0;
+    Swar::word_t* out = (Swar::word_t*)buffer;
+    auto pair = [&]() {
+      const sample_t lo = b.step(buffer[0]);
+      const sample_t hi = b.step(buffer[1]);
+      buffer += 2;
+      const uint32_t w = uint32_t(uint16_t(lo.getInternal()))
+        | uint32_t(hi.getInternal()) << 16;
+      *out++ = Dac::convert(w, clipped);
+    };
+    for (; count >= block_count; count -= block_count)
+      for (int i = 0; i < block_count / 2; ++i)
+        pair();
+    for (; count >= 2; count -= 2)
+      pair();
+    if (count)
+      *(uint16_t*)buffer = Dac::convert(b.step(*buffer), clipped);
+    b.done();
+    return clipped;
+  }
+};
+
+
+template<int factor, template<int> class Kernel = CubicKernel>
+class Upsampler {
+  // Brings blocks of samples up by factor, as DmaDac does to the graph's
+  // output when ENGINE_DIVISOR is more than one. The last few samples of
+  // each block are carried over, so the blocks join up seamlessly; the
+  // output lags the input by Kernel::taps - 1 - Kernel::before samples.
+public:
+  Upsampler() {
+    Zeros z;
+    window.begin(z);
+  }
+
+  void run(const sample_t* in, int count, sample_t* out) {
+    // writes count * factor samples to out
+    Block b = { in };
+    const comp_t a = comp_t(1) / Interp::scale;
+    auto step = [&](const int16_t* taps) {
+      Interp::template step<StoreSamples>(out, taps, a, tapToComp);
+    };
+    window.run(b, count, step);
+  }
+
+private:
+  using Interp = Interpolator<factor, Kernel>;
+  using comp_t = SFixed<15, 16>;
+  static constexpr int32_t tapToComp =
+    1 << (comp_t::FractionSize - sample_t::FractionSize);
+
+  struct Zeros {
+    void read(int16_t* w, int n) { while (n--) *w++ = 0; }
+  };
+  struct Block {
+    const sample_t* next;
+    void read(int16_t* w, int n) {
+      while (n--) *w++ = (*next++).getInternal();
+    }
+  };
 
-  sample_t tank[maxDelaySamples];
-  int writeP;
+  SampleWindow<Interp> window;
 };
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "sample.h"
+
+/* Kernels that work on two samples at a time, packed into one 32 bit word.
+ *
+ * The Cortex-M0+ has 32 bit registers and no SIMD instructions, so these use
+ * SWAR ("SIMD within a register") tricks, arranged so that carries and
+ * borrows never cross from one 16 bit lane into the other.
+ *
+ * Each block function has a reference version in Swar::Scalar that does the
+ * same thing one sample at a time. The two must give bit identical results;
+ * pbox-bench checks this on the host.
+ *
+ * Buffers passed to scaleBlock() and dacBlock() must be 4 byte aligned.
+ */
+
+namespace Swar {
+
+  typedef uint32_t __attribute__((__may_alias__)) word_t;
+  typedef int16_t __attribute__((__may_alias__)) half_t;
+
+  static_assert(sizeof(sample_t) == sizeof(int16_t),
+    "sample_t must be 16 bits to pack two per word");
+
+  constexpr uint32_t H = 0x80008000;    // high bit of each lane
+  constexpr uint32_t L = 0x00010001;    // low bit of each lane
+
+  constexpr uint32_t lanes(uint32_t v) { return v * L; }
+
+  inline uint32_t add(uint32_t a, uint32_t b) {
+    // wrapping add of each lane, as sample_t + sample_t does
+    return ((a & ~H) + (b & ~H)) ^ ((a ^ b) & H);
+  }
+
+  inline uint32_t scale(uint32_t x, sample_t g) {
+    // each lane times g, as sample_t * sample_t does
+    // NB: There's no packed multiply, so this is one multiply per lane, but
+    //     still one load and store per pair of samples.
+    constexpr int fs = sample_t::FractionSize;
+    const int32_t gi = g.getInternal();
+    int32_t lo = (int32_t(half_t(x)) * gi) >> fs;
+    int32_t hi = ((int32_t(x) >> 16) * gi) >> fs;
+    return (uint32_t(lo) & 0xffff) | (uint32_t(hi) << 16);
+  }
+
+  inline uint32_t laneMask(uint32_t t) {
+    // from the high bits of each lane in t, a mask of those whole lanes
+    return ((t & H) >> 15) * 0xffff;
+  }
+
+  template<int dac_bits>
+  struct Dac {
+    // converting samples to unsigned DAC values, centered on the DAC's zero
+
+    static constexpr int bits = dac_bits;
+    static constexpr int shift = sample_t::FractionSize - (dac_bits - 1);
+    static_assert(shift > 0, "need guard bits above each lane");
+
+    static constexpr int32_t zero = 1 << (dac_bits - 1);
+    static constexpr int32_t unit = zero - 1;
+    static constexpr int32_t bias = 0x8000 >> shift;
+
+    static inline uint32_t convert(uint32_t x, int& clipped) {
+      // Offset binary lanes shift right without sign extension, and then
+      // have shift bits of headroom, so compares can borrow from the top bit.
+      uint32_t u = ((x ^ H) >> shift) & lanes(0xffff >> shift);
+
+      uint32_t over = laneMask((u | H) - lanes(bias + unit + 1));
+      uint32_t under = ~laneMask((u | H) - lanes(bias - unit));
+
+      u = (u & ~(over | under))
+        | (lanes(bias + unit) & over)
+        | (lanes(bias - unit) & under);
+
+      uint32_t c = (over | under) & H;
+      clipped += (c >> 15 & 1) + (c >> 31);
+
+      return u - lanes(bias - zero);
+    }
+
+    static inline uint16_t convert(sample_t s, int& clipped) {
+      int32_t v = s.getInternal() >> shift;
+      if (v > unit)         { v = unit;  clipped++; }
+      else if (v < -unit)   { v = -unit; clipped++; }
+      return uint16_t(v + zero);
+    }
+  };
+
+
+  inline bool dacWidth(int dac_bits) {
+    // if withDac() has a Dac for dac_bits: the widths the DmaDac outputs use
+    return dac_bits == DAC_BITS || dac_bits == 12;
+  }
+
+  template<typename F>
+  inline auto withDac(int dac_bits, F f) -> decltype(f(Dac<DAC_BITS>())) {
+    // calls f with a Dac for dac_bits, chosen at run time
+    static_assert(DAC_BITS != 12, "a width listed twice");
+    switch (dac_bits) {
+      case DAC_BITS:  return f(Dac<DAC_BITS>());
+      case 12:        return f(Dac<12>());
+      default:        __builtin_trap();
+        // NB: DmaDac::begin() refuses an output of any other width, so
+        //     getting here is a bug: better to stop than play wrong values.
+    }
+  }
+
+
+  inline bool aligned(const void* p) { return ((uintptr_t)p & 3) == 0; }
+
+  namespace Scalar {
+    inline void addBlock(sample_t* dst, const sample_t* src, int count) {
+      while (count--) { *dst = *dst + *src++; ++dst; }
+    }
+
+    inline void scaleBlock(sample_t* buf, sample_t g, int count) {
+      while (count--) { *buf = *buf * g; ++buf; }
+    }
+
+    template<int dac_bits>
+    inline int dacBlock(sample_t* buf, int count) {
+      int clipped = 0;
+      uint16_t* out = (uint16_t*)buf;
+      while (count--)
+        *out++ = Dac<dac_bits>::convert(*buf++, clipped);
+      return clipped;
+    }
+  }
+
+
+  inline void addBlock(sample_t* dst, const sample_t* src, int count) {
+    if (!aligned(dst) || !aligned(src)) {
+      Scalar::addBlock(dst, src, count);
+      return;
+    }
+    word_t* d = (word_t*)dst;
+    const word_t* s = (const word_t*)src;
+    for (int n = count / 2; n; --n, ++d)
+      *d = add(*d, *s++);
+    if (count & 1)
+      dst[count - 1] = dst[count - 1] + src[count - 1];
+  }
+
+  inline void scaleBlock(sample_t* buf, sample_t g, int count) {
+    word_t* b = (word_t*)buf;
+    for (int n = count / 2; n; --n, ++b)
+      *b = scale(*b, g);
+    if (count & 1)
+      buf[count - 1] = buf[count - 1] * g;
+  }
+
+  template<int dac_bits>
+  inline int dacBlock(sample_t* buf, int count) {
+    // converts, in place, to DAC values, and returns the number clipped
+    int clipped = 0;
+    word_t* b = (word_t*)buf;
+    for (int n = count / 2; n; --n, ++b)
+      *b = Dac<dac_bits>::convert(uint32_t(*b), clipped);
+    if (count & 1)
+      ((uint16_t*)buf)[count - 1] =
+        Dac<dac_bits>::convert(buf[count - 1], clipped);
+    return clipped;
+  }
+
+  inline int dacBlock(int dac_bits, sample_t* buf, int count) {
+    return withDac(dac_bits, [&](auto dac) {
+      return dacBlock<decltype(dac)::bits>(buf, count);
+    });
+  }
+}